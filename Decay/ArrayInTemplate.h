@@ -6,17 +6,24 @@ namespace NS_CArrayInArgs {
 
 // Pass array by reference: T (&arr) [N]
 
-template <typename T, size_t N>
-void Array_Info(const wchar_t* name, T (&arr)[N]) {
-  std::wcout << L"Size of array \"" << name << L"\" is: " << N << std::endl;
+// |out| is std::wcout or anything with the same operator<<, e.g. Utf8Buffer.
+
+template <typename Out, typename T, size_t N>
+void Array_Info(Out& out, const wchar_t* name, T (&arr)[N]) {
+  out << L"Size of array \"" << name << L"\" is: " << N << std::endl;
 }
 
-template <size_t N>
-void Array_Info(const wchar_t* name, wchar_t (&arr)[N]) {
-  std::wcout << L"Size[1] of char-array \"" << name << L"\" is: " << N
-             << std::endl;
-  std::wcout << L"Size[2] of char-array \"" << name << L"\" is: " << std::size(arr)
-             << std::endl;
+template <typename Out, size_t N>
+void Array_Info(Out& out, const wchar_t* name, wchar_t (&arr)[N]) {
+  out << L"Size[1] of char-array \"" << name << L"\" is: " << N
+      << std::endl;
+  out << L"Size[2] of char-array \"" << name << L"\" is: " << std::size(arr)
+      << std::endl;
+}
+
+template <typename T, size_t N>
+void Array_Info(const wchar_t* name, T (&arr)[N]) {
+  Array_Info(std::wcout, name, arr);
 }
 
 void Test() {
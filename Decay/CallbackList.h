@@ -0,0 +1,489 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+#include "VariadicTemplate.h"
+
+// Callback list for signal/observer fan-out.
+
+// Callbacks are the bound std::function objects produced by BindFunction()
+// (VariadicTemplate.h) or any lambda. See Doc/bind/callback.md for the
+// cancellation model this follows: Add() returns a subscription, destroying or
+// cancelling it removes the callback.
+
+// Notify() never waits for a writer. The subscribers live in an immutable
+// snapshot (copy-on-write): Add()/Remove() build a new vector under a writer
+// mutex and publish it with one atomic exchange. Readers protect the snapshot
+// they are iterating with an epoch counter:
+//   * A reader increments m_readers[epoch & 1] and re-checks that the epoch
+//     did not move, then loads the snapshot.
+//   * A writer retires the old snapshot and flips the epoch, so new readers
+//     count on the other side. The old snapshot is freed once each of the two
+//     reader counters has been seen at zero after it was unpublished: every
+//     reader that could still hold it was counted before the exchange.
+// Writers free what is drained when they publish. After iterating, Notify()
+// also try_locks the writer mutex to free retired snapshots, so a cancelled
+// callback is released without waiting for the next Add()/Remove(); if a
+// writer holds the mutex it skips this and leaves the work to that writer.
+// A removed callback is flagged inactive at once, so a notification already
+// in flight skips it, while one that is running keeps a valid object until the
+// snapshot that references it is freed.
+
+class CallbackListSubscription {
+ public:
+  CallbackListSubscription() = default;
+
+  explicit CallbackListSubscription(std::function<void()> cancel)
+      : m_cancel(std::move(cancel)) {}
+
+  CallbackListSubscription(CallbackListSubscription&& other) noexcept
+      : m_cancel(std::move(other.m_cancel)) {
+    other.m_cancel = nullptr;
+  }
+
+  CallbackListSubscription& operator=(CallbackListSubscription&& other) {
+    if (this != &other) {
+      Cancel();
+      m_cancel = std::move(other.m_cancel);
+      other.m_cancel = nullptr;
+    }
+    return *this;
+  }
+
+  CallbackListSubscription(const CallbackListSubscription&) = delete;
+  CallbackListSubscription& operator=(const CallbackListSubscription&) =
+      delete;
+
+  ~CallbackListSubscription() { Cancel(); }
+
+  // Removes the callback from its list; a no-op if the list is gone.
+  void Cancel() {
+    if (!m_cancel)
+      return;
+    std::function<void()> cancel = std::move(m_cancel);
+    m_cancel = nullptr;
+    cancel();
+  }
+
+  explicit operator bool() const { return static_cast<bool>(m_cancel); }
+
+ private:
+  std::function<void()> m_cancel;
+};
+
+template <typename Signature>
+class CallbackList;
+
+template <typename R, typename... Args>
+class CallbackList<R(Args...)> {
+ public:
+  using CallbackType = std::function<R(Args...)>;
+
+  CallbackList() : m_state(std::make_shared<State>()) {}
+
+  CallbackList(const CallbackList&) = delete;
+  CallbackList& operator=(const CallbackList&) = delete;
+
+  CallbackListSubscription Add(CallbackType callback) {
+    const uint64_t id = m_state->Add(std::move(callback));
+    std::weak_ptr<State> weak_state = m_state;
+    return CallbackListSubscription([weak_state, id] {
+      if (std::shared_ptr<State> state = weak_state.lock())
+        state->Remove(id);
+    });
+  }
+
+  // Runs every active callback with |args|, in subscription order.
+  template <typename... RunArgs>
+  void Notify(RunArgs&&... args) {
+    m_state->Notify(args...);
+  }
+
+  size_t size() const { return m_state->size(); }
+
+ private:
+  struct Entry {
+    Entry(uint64_t id, CallbackType callback)
+        : id(id), callback(std::move(callback)) {}
+    uint64_t id;
+    CallbackType callback;
+    std::atomic<bool> active{true};
+  };
+
+  using Snapshot = std::vector<std::shared_ptr<Entry>>;
+
+  class State {
+   public:
+    State() : m_snapshot(new Snapshot) {}
+
+    ~State() {
+      delete m_snapshot.load();
+      for (Retired& retired : m_retired)
+        delete retired.snapshot;
+    }
+
+    uint64_t Add(CallbackType callback) {
+      std::vector<Snapshot*> reclaimable;
+      uint64_t id = 0;
+      {
+        std::lock_guard<std::mutex> lock(m_writer_mutex);
+        id = m_next_id++;
+        Snapshot* fresh = new Snapshot(*m_snapshot.load());
+        fresh->push_back(std::make_shared<Entry>(id, std::move(callback)));
+        reclaimable = PublishLocked(fresh);
+      }
+      Free(reclaimable);
+      return id;
+    }
+
+    void Remove(uint64_t id) {
+      std::vector<Snapshot*> reclaimable;
+      {
+        std::lock_guard<std::mutex> lock(m_writer_mutex);
+        const Snapshot& current = *m_snapshot.load();
+        auto it = std::find_if(
+            current.begin(), current.end(),
+            [id](const std::shared_ptr<Entry>& e) { return e->id == id; });
+        if (it == current.end())
+          return;
+        (*it)->active.store(false);
+        Snapshot* fresh = new Snapshot;
+        fresh->reserve(current.size() - 1);
+        for (const std::shared_ptr<Entry>& e : current) {
+          if (e->id != id)
+            fresh->push_back(e);
+        }
+        reclaimable = PublishLocked(fresh);
+      }
+      Free(reclaimable);
+    }
+
+    template <typename... RunArgs>
+    void Notify(RunArgs&... args) {
+      {
+        ReadGuard guard(*this);
+        for (const std::shared_ptr<Entry>& e : *guard.snapshot()) {
+          if (e->active.load(std::memory_order_acquire))
+            e->callback(args...);
+        }
+      }
+      // Readers help free retired snapshots, but never wait for a writer.
+      if (m_retired_count.load(std::memory_order_relaxed) != 0) {
+        std::vector<Snapshot*> reclaimable;
+        {
+          std::unique_lock<std::mutex> lock(m_writer_mutex, std::try_to_lock);
+          if (lock.owns_lock())
+            reclaimable = CollectLocked();
+        }
+        Free(reclaimable);
+      }
+    }
+
+    size_t size() const {
+      ReadGuard guard(*this);
+      return guard.snapshot()->size();
+    }
+
+   private:
+    struct Retired {
+      Snapshot* snapshot;
+      bool drained[2];
+    };
+
+    class ReadGuard {
+     public:
+      explicit ReadGuard(const State& state) : m_state(state) {
+        for (;;) {
+          const uint64_t epoch = m_state.m_epoch.load();
+          m_side = static_cast<size_t>(epoch & 1);
+          m_state.m_readers[m_side].fetch_add(1);
+          if (m_state.m_epoch.load() == epoch)
+            break;
+          m_state.m_readers[m_side].fetch_sub(1);
+        }
+        m_snapshot = m_state.m_snapshot.load();
+      }
+
+      ~ReadGuard() { m_state.m_readers[m_side].fetch_sub(1); }
+
+      const Snapshot* snapshot() const { return m_snapshot; }
+
+     private:
+      const State& m_state;
+      size_t m_side = 0;
+      const Snapshot* m_snapshot = nullptr;
+    };
+
+    std::vector<Snapshot*> PublishLocked(Snapshot* fresh) {
+      Snapshot* old = m_snapshot.exchange(fresh);
+      m_retired.push_back(Retired{old, {false, false}});
+      return CollectLocked();
+    }
+
+    // Returns the retired snapshots no reader can hold any more. They are
+    // freed by the caller after the writer mutex is released, because
+    // destroying a callback may cancel another subscription of this list.
+    std::vector<Snapshot*> CollectLocked() {
+      m_epoch.fetch_add(1);
+      std::vector<Snapshot*> reclaimable;
+      for (size_t i = 0; i < m_retired.size();) {
+        Retired& retired = m_retired[i];
+        for (size_t side = 0; side < 2; ++side) {
+          if (m_readers[side].load() == 0)
+            retired.drained[side] = true;
+        }
+        if (retired.drained[0] && retired.drained[1]) {
+          reclaimable.push_back(retired.snapshot);
+          m_retired[i] = m_retired.back();
+          m_retired.pop_back();
+        } else {
+          ++i;
+        }
+      }
+      m_retired_count.store(m_retired.size(), std::memory_order_relaxed);
+      return reclaimable;
+    }
+
+    static void Free(const std::vector<Snapshot*>& snapshots) {
+      for (Snapshot* snapshot : snapshots)
+        delete snapshot;
+    }
+
+    std::atomic<Snapshot*> m_snapshot;
+    std::atomic<uint64_t> m_epoch{0};
+    mutable std::atomic<size_t> m_readers[2] = {{0}, {0}};
+    std::atomic<size_t> m_retired_count{0};
+
+    // Guarded by m_writer_mutex.
+    std::mutex m_writer_mutex;
+    std::vector<Retired> m_retired;
+    uint64_t m_next_id = 0;
+  };
+
+  std::shared_ptr<State> m_state;
+};
+
+// ###############################################################################
+
+TEST(CallbackList, CallbackList) {
+  CallbackList<void(int)> list;
+  int sum = 0;
+  CallbackListSubscription a = list.Add([&](int x) { sum += x; });
+  CallbackListSubscription b = list.Add([&](int x) { sum += 10 * x; });
+  list.Notify(1);
+  ASSERT_EQ(sum, 11);
+
+  b.Cancel();
+  ASSERT_FALSE(b);
+  list.Notify(1);
+  ASSERT_EQ(sum, 12);
+
+  // Destroying the subscription cancels it.
+  { CallbackListSubscription c = list.Add([&](int x) { sum += 100 * x; }); }
+  list.Notify(1);
+  ASSERT_EQ(sum, 13);
+
+  // A callback may remove itself and a later callback while running; the
+  // later one is skipped by the notification already in flight.
+  CallbackListSubscription self;
+  CallbackListSubscription later;
+  int self_runs = 0;
+  self = list.Add([&](int) {
+    ++self_runs;
+    self.Cancel();
+    later.Cancel();
+  });
+  later = list.Add([&](int) { FAIL() << "removed callback was run"; });
+  list.Notify(0);
+  list.Notify(0);
+  ASSERT_EQ(self_runs, 1);
+  ASSERT_EQ(list.size(), 1u);
+
+  // Bound member functions from BindFunction().
+  CallbackList<bool(MemObj&)> bound;
+  CallbackListSubscription mem =
+      bound.Add(BindFunction(&MemObj::MemFunc, true, 1, 1.0f, 1.0));
+  MemObj mem_obj;
+  bound.Notify(mem_obj);
+
+  // Subscriptions may outlive their list.
+  CallbackListSubscription orphan;
+  {
+    CallbackList<void()> short_lived;
+    orphan = short_lived.Add([] {});
+  }
+  orphan.Cancel();
+}
+
+// Several threads notify while another subscribes and cancels, and callbacks
+// cancel their own subscription from whichever notifying thread runs them.
+TEST(CallbackList, ConcurrentNotifyAndCancel) {
+  const int kNotifiers = 4;
+  const int kRounds = 2000;
+  const int kStable = 8;
+  CallbackList<void(int)> list;
+
+  std::atomic<int> stable_calls[kStable] = {};
+  std::vector<CallbackListSubscription> stable;
+  for (int i = 0; i < kStable; ++i) {
+    stable.push_back(list.Add([&stable_calls, i](int x) {
+      stable_calls[i].fetch_add(x, std::memory_order_relaxed);
+    }));
+  }
+
+  // The mutex keeps the callback from cancelling before Add() has returned
+  // the subscription, and serializes the notifiers which run it at once.
+  struct SelfCancelling {
+    std::mutex mutex;
+    CallbackListSubscription subscription;
+    int runs = 0;
+  };
+  std::vector<std::shared_ptr<SelfCancelling>> self_cancelling;
+
+  std::atomic<int> running{kNotifiers};
+  std::thread churn([&] {
+    while (running.load() != 0) {
+      list.Add([](int) {}).Cancel();
+      auto self = std::make_shared<SelfCancelling>();
+      std::lock_guard<std::mutex> lock(self->mutex);
+      self->subscription = list.Add([self](int) {
+        std::lock_guard<std::mutex> lock(self->mutex);
+        ++self->runs;
+        self->subscription.Cancel();
+      });
+      self_cancelling.push_back(std::move(self));
+    }
+  });
+  std::vector<std::thread> notifiers;
+  for (int t = 0; t < kNotifiers; ++t) {
+    notifiers.emplace_back([&] {
+      for (int round = 0; round < kRounds; ++round)
+        list.Notify(1);
+      running.fetch_sub(1);
+    });
+  }
+  for (std::thread& notifier : notifiers)
+    notifier.join();
+  churn.join();
+
+  // A callback runs at most once per notifying thread: only notifications
+  // which passed the active check before it cancelled itself can run it.
+  for (const auto& self : self_cancelling) {
+    std::lock_guard<std::mutex> lock(self->mutex);
+    ASSERT_LE(self->runs, kNotifiers);
+    ASSERT_EQ(static_cast<bool>(self->subscription), self->runs == 0);
+    self->subscription.Cancel();
+  }
+  ASSERT_EQ(list.size(), static_cast<size_t>(kStable));
+  for (const std::atomic<int>& calls : stable_calls)
+    ASSERT_EQ(calls.load(), kNotifiers * kRounds);
+
+  self_cancelling.clear();
+  stable.clear();
+  ASSERT_EQ(list.size(), 0u);
+}
+
+// ###############################################################################
+
+// Benchmark: notify throughput with 1000 subscribers while another thread
+// subscribes and unsubscribes, against a mutex-guarded
+// std::vector<std::function>.
+// Disabled by default, run with --gtest_also_run_disabled_tests.
+
+namespace NS_CallbackList {
+
+class LockedCallbackList {
+ public:
+  uint64_t Add(std::function<void(int)> callback) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_callbacks.emplace_back(m_next_id, std::move(callback));
+    return m_next_id++;
+  }
+
+  void Remove(uint64_t id) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_callbacks.erase(
+        std::find_if(m_callbacks.begin(), m_callbacks.end(),
+                     [id](const auto& entry) { return entry.first == id; }));
+  }
+
+  void Notify(int x) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (const auto& entry : m_callbacks)
+      entry.second(x);
+  }
+
+ private:
+  std::mutex m_mutex;
+  std::vector<std::pair<uint64_t, std::function<void(int)>>> m_callbacks;
+  uint64_t m_next_id = 0;
+};
+
+// Returns notifications per second.
+template <typename AddFunc, typename RemoveFunc, typename NotifyFunc>
+double BenchChurn(size_t notifications,
+                  AddFunc add,
+                  RemoveFunc remove,
+                  NotifyFunc notify) {
+  std::atomic<bool> done{false};
+  std::thread churn([&] {
+    while (!done.load(std::memory_order_relaxed))
+      remove(add());
+  });
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < notifications; ++i)
+    notify();
+  auto stop = std::chrono::steady_clock::now();
+  done = true;
+  churn.join();
+  return notifications /
+         std::chrono::duration<double>(stop - start).count();
+}
+
+}  // namespace NS_CallbackList
+
+TEST(CallbackList, DISABLED_Benchmark) {
+  using namespace NS_CallbackList;
+
+  const size_t kSubscribers = 1000;
+  const size_t kNotifications = 2000;
+  long long sink = 0;
+  auto callback = [&sink](int x) { sink += x; };
+
+  CallbackList<void(int)> lock_free;
+  std::vector<CallbackListSubscription> subscriptions;
+  for (size_t i = 0; i < kSubscribers; ++i)
+    subscriptions.push_back(lock_free.Add(callback));
+
+  LockedCallbackList locked;
+  for (size_t i = 0; i < kSubscribers; ++i)
+    locked.Add(callback);
+
+  std::wcout << std::fixed << std::setprecision(1);
+  std::wcout << L"CallbackList         "
+             << BenchChurn(
+                    kNotifications,
+                    [&] { return lock_free.Add([](int) {}); },
+                    [](CallbackListSubscription s) { s.Cancel(); },
+                    [&] { lock_free.Notify(1); })
+             << L" notify/s" << std::endl;
+  std::wcout << L"mutex + std::vector  "
+             << BenchChurn(
+                    kNotifications, [&] { return locked.Add([](int) {}); },
+                    [&](uint64_t id) { locked.Remove(id); },
+                    [&] { locked.Notify(1); })
+             << L" notify/s (checksum " << sink << L")" << std::endl;
+}
@@ -14,6 +14,13 @@
 #include "VariadicTemplate.h"
 #include "EnableIf.h"
 #include "CompileTimeComputation.h"
+#include "TriviallyRelocatable.h"
+#include "PackedTuple.h"
+#include "RingBuffer.h"
+#include "TypeMap.h"
+#include "Utf8Transcoding.h"
+#include "CallbackList.h"
+#include "TimingWheel.h"
 
 namespace NS_Function {
 
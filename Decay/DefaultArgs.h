@@ -7,6 +7,10 @@
 template <typename ElementType, size_t Size = 10>
 class Array {
  public:
+  static constexpr size_t size() { return Size; }
+
+  ElementType& operator[](size_t index) { return m_date[index]; }
+  const ElementType& operator[](size_t index) const { return m_date[index]; }
 
  private:
   ElementType m_date[Size];
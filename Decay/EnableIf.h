@@ -3,40 +3,66 @@
 // std::enable_if
 // std::enable_if_t = std::enable_if<bool, type>::type
 
+// Every example prints to |out| (std::wcout, a Utf8Buffer, ...); the overload
+// without |out| prints to std::wcout.
+
 // 1. in function return type
 
+template <typename Out, typename T>
+typename std::enable_if<std::is_integral<T>::value, void>::type ClassifyTypeInReturn(
+    Out& out, T value) {
+  out << L"Type = integral;" << " 3 * value = " << 3 * value << std::endl;
+}
+
 template <typename T>
 typename std::enable_if<std::is_integral<T>::value, void>::type ClassifyTypeInReturn(
     T value) {
-  std::wcout << L"Type = integral;" << " 3 * value = " << 3 * value
-             << std::endl;
+  ClassifyTypeInReturn(std::wcout, value);
 }
 
 // 2. in trailing return type
 
+template <typename Out, typename T>
+auto ClassifyTypeInTrailingReturn(Out& out, T value) ->
+    typename std::enable_if<std::is_integral<T>::value, void>::type {
+  out << L"Type = integral;" << " 3 * value = " << 3 * value << std::endl;
+}
+
 template <typename T>
 auto ClassifyTypeInTrailingReturn(T value) ->
     typename std::enable_if<std::is_integral<T>::value, void>::type {
-  std::wcout << L"Type = integral;" << " 3 * value = " << 3 * value
-             << std::endl;
+  ClassifyTypeInTrailingReturn(std::wcout, value);
 }
 
 // 3. in parameter
 
+template <typename Out, typename T>
+void ClassifyTypeInParameter(Out& out, T value,
+                  typename std::enable_if<std::is_integral<T>::value,
+                                          void>::type* = nullptr) {
+  out << L"Type = integral;" << " 3 * value = " << 3 * value << std::endl;
+}
+
 template <typename T>
 void ClassifyTypeInParameter(T value,
                   typename std::enable_if<std::is_integral<T>::value,
                                           void>::type* = nullptr) {
-  std::wcout << L"Type = integral;" << " 3 * value = " << 3 * value
-             << std::endl;
+  ClassifyTypeInParameter(std::wcout, value);
 }
 
 // 4. template type parameter
 
+template <
+    typename Out,
+    typename T,
+    typename std::enable_if<std::is_integral<T>::value, void>::type* = nullptr>
+    void ClassifyTypeInFunction(Out& out, T value) {
+  out << L"Type = integral;" << " 3 * value = " << 3 * value << std::endl;
+}
+
 template <
     typename T,
     typename std::enable_if<std::is_integral<T>::value, void>::type* = nullptr>
     void ClassifyTypeInFunction(T value) {
-  std::wcout << L"Type = integral;" << " 3 * value = " << 3 * value
-             << std::endl;
+  ClassifyTypeInFunction(std::wcout, value);
 }
@@ -49,28 +49,29 @@ struct TypeInfo<type> { \
 REGISTER_TYPE_INFO(bool, false)
 REGISTER_TYPE_INFO(int, true)
 
+// Prints TypeInfo<T> to |out|: std::wcout or e.g. a Utf8Buffer.
+
+template <typename T, typename Out>
+void PrintTypeInfo(Out& out) {
+  out << L"TypeInfo for " << TypeInfo<T>::name << L" size = "
+      << TypeInfo<T>::size << L" is_number: " << TypeInfo<T>::is_number
+      << L" is_pointer: " << TypeInfo<T>::is_pointer << L" is_const: "
+      << TypeInfo<T>::is_const << std::endl;
+}
+
 // Pre-defined type traits in <type_traits>
 #include <type_traits>
 
 namespace NS_MetaFunctionAndTypeTraits {
 
-void Test() {
-  std::wcout << L"########## Test For NS_MetaFunctionAndTypeTraits ##########" << std::endl;
-  std::wcout << L"IsPointer<int>::value: " << IsPointer<int>::value
-             << std::endl;
-  std::wcout << L"IsPointer<int*>::value: " << IsPointer<int*>::value
-             << std::endl;
-
-  std::wcout << L"TypeInfo for " << TypeInfo<bool>::name << L" size = "
-             << TypeInfo<bool>::size << L" is_number: "
-             << TypeInfo<bool>::is_number << L" is_pointer: "
-             << TypeInfo<bool>::is_pointer << L" is_const: "
-             << TypeInfo<bool>::is_const << std::endl;
-  std::wcout << L"TypeInfo for " << TypeInfo<const bool>::name << L" size = "
-             << TypeInfo<const bool>::size << L" is_number: "
-             << TypeInfo<const bool>::is_number << L" is_pointer: "
-             << TypeInfo<const bool>::is_pointer << L" is_const: "
-             << TypeInfo<const bool>::is_const << std::endl;
+template <typename Out>
+void Test(Out& out) {
+  out << L"########## Test For NS_MetaFunctionAndTypeTraits ##########" << std::endl;
+  out << L"IsPointer<int>::value: " << IsPointer<int>::value << std::endl;
+  out << L"IsPointer<int*>::value: " << IsPointer<int*>::value << std::endl;
+
+  PrintTypeInfo<bool>(out);
+  PrintTypeInfo<const bool>(out);
 
   static_assert(std::is_void<void>::value,
                 L"std::is_void<void>::value is true");
@@ -83,4 +84,8 @@ void Test() {
   static_assert(!std::is_base_of<int, int>::value, L"std::is_base::of");
 }
 
+void Test() {
+  Test(std::wcout);
+}
+
 }  // namespace NS_MetaFunctionAndTypeTraits
@@ -0,0 +1,477 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "ExtractReturnAndArgs.h"
+#include "TriviallyRelocatable.h"
+
+// Padding-minimizing tuple.
+
+// A struct stores its members in declaration order and pads each one up to its
+// alignment, so { char, double, char } costs 24 bytes for 10 bytes of data.
+// Storing the members by decreasing alignment removes every internal gap:
+// each size is a multiple of its alignment, so every following member is
+// already aligned. PackedTuple<Ts...> computes that order at compile time and
+// keeps get<I>() indexed by the declared order.
+
+// 1. PackedLayout<Ts...>: compile-time layout report.
+
+template <typename... Ts>
+struct PackedLayout {
+  static constexpr size_t kCount = sizeof...(Ts);
+  static constexpr std::array<size_t, kCount> kSizes{{sizeof(Ts)...}};
+  static constexpr std::array<size_t, kCount> kAligns{{alignof(Ts)...}};
+
+  static constexpr size_t RoundUp(size_t value, size_t align) {
+    return (value + align - 1) / align * align;
+  }
+
+  static constexpr size_t ComputeMaxAlign() {
+    size_t max_align = 1;
+    for (size_t i = 0; i < kCount; ++i)
+      max_align = kAligns[i] > max_align ? kAligns[i] : max_align;
+    return max_align;
+  }
+
+  // Declared indices in storage order: stable insertion sort by decreasing
+  // alignment.
+  static constexpr std::array<size_t, kCount> ComputeOrder() {
+    std::array<size_t, kCount> order{};
+    for (size_t i = 0; i < kCount; ++i) {
+      size_t j = i;
+      for (; j > 0 && kAligns[order[j - 1]] < kAligns[i]; --j)
+        order[j] = order[j - 1];
+      order[j] = i;
+    }
+    return order;
+  }
+
+  // Offsets indexed by declared index, when laid out in |order|.
+  static constexpr std::array<size_t, kCount> ComputeOffsets(
+      const std::array<size_t, kCount>& order) {
+    std::array<size_t, kCount> offsets{};
+    size_t offset = 0;
+    for (size_t i = 0; i < kCount; ++i) {
+      offset = RoundUp(offset, kAligns[order[i]]);
+      offsets[order[i]] = offset;
+      offset += kSizes[order[i]];
+    }
+    return offsets;
+  }
+
+  static constexpr size_t ComputeSize(
+      const std::array<size_t, kCount>& order) {
+    size_t end = 0;
+    const std::array<size_t, kCount> offsets = ComputeOffsets(order);
+    for (size_t i = 0; i < kCount; ++i)
+      end = offsets[i] + kSizes[i] > end ? offsets[i] + kSizes[i] : end;
+    return end == 0 ? 1 : RoundUp(end, ComputeMaxAlign());
+  }
+
+  static constexpr std::array<size_t, kCount> ComputeDeclaredOrder() {
+    std::array<size_t, kCount> order{};
+    for (size_t i = 0; i < kCount; ++i)
+      order[i] = i;
+    return order;
+  }
+
+  static constexpr size_t kMaxAlign = ComputeMaxAlign();
+  static constexpr std::array<size_t, kCount> kOrder = ComputeOrder();
+  static constexpr std::array<size_t, kCount> kOffsets =
+      ComputeOffsets(kOrder);
+  static constexpr size_t kPackedSize = ComputeSize(kOrder);
+
+  // Size of a plain struct with the members in declared order.
+  static constexpr size_t kDeclaredSize = ComputeSize(ComputeDeclaredOrder());
+  static constexpr size_t kBytesSaved = kDeclaredSize - kPackedSize;
+};
+
+template <typename... Ts>
+void PrintPackedLayout() {
+  using Layout = PackedLayout<Ts...>;
+  std::wcout << std::right << std::setw(8) << L"Storage" << std::setw(8)
+             << L"Index" << std::setw(6) << L"Size" << std::setw(7)
+             << L"Align" << std::setw(8) << L"Offset" << std::endl;
+  for (size_t i = 0; i < Layout::kCount; ++i) {
+    const size_t index = Layout::kOrder[i];
+    std::wcout << std::setw(8) << i << std::setw(8) << index << std::setw(6)
+               << Layout::kSizes[index] << std::setw(7)
+               << Layout::kAligns[index] << std::setw(8)
+               << Layout::kOffsets[index] << std::endl;
+  }
+  std::wcout << L"declared size = " << Layout::kDeclaredSize
+             << L", packed size = " << Layout::kPackedSize
+             << L", bytes saved = " << Layout::kBytesSaved << std::endl;
+}
+
+// 2. PackedTuple<Ts...>: elements live in one aligned buffer at the offsets
+// computed by PackedLayout<Ts...>.
+
+// When every element is trivially copyable and destructible, so is the tuple
+// (copies are memcpy, std::vector growth is memmove). Otherwise the copy/move
+// operations are written out, with moves noexcept whenever the elements' are
+// so std::vector moves instead of copying on growth. A constructor that throws
+// part-way destroys the elements it already built.
+
+template <typename... Ts>
+class PackedTupleStorage {
+ public:
+  using Layout = PackedLayout<Ts...>;
+
+  template <size_t I>
+  using ElementType = typename std::tuple_element<I, std::tuple<Ts...>>::type;
+
+  template <size_t I>
+  ElementType<I>& get() {
+    return *std::launder(
+        reinterpret_cast<ElementType<I>*>(m_storage + Layout::kOffsets[I]));
+  }
+
+  template <size_t I>
+  const ElementType<I>& get() const {
+    return *std::launder(reinterpret_cast<const ElementType<I>*>(
+        m_storage + Layout::kOffsets[I]));
+  }
+
+ protected:
+  using Indices = std::index_sequence_for<Ts...>;
+
+  struct Uninitialized {};
+  struct FromValues {};
+
+  PackedTupleStorage() { Construct(Indices{}); }
+
+  template <typename... Args>
+  PackedTupleStorage(FromValues, Args&&... args) {
+    Construct(Indices{}, std::forward<Args>(args)...);
+  }
+
+  explicit PackedTupleStorage(Uninitialized) {}
+
+  template <size_t... Is, typename... Args>
+  void Construct(std::index_sequence<Is...>, Args&&... args) {
+    size_t built = 0;
+    try {
+      if constexpr (sizeof...(Args) == 0) {
+        ((::new (Address<Is>()) ElementType<Is>(), ++built), ...);
+      } else {
+        ((::new (Address<Is>()) ElementType<Is>(std::forward<Args>(args)),
+          ++built),
+         ...);
+      }
+    } catch (...) {
+      DestroyFirst(built);
+      throw;
+    }
+  }
+
+  template <size_t... Is>
+  void CopyFrom(const PackedTupleStorage& other, std::index_sequence<Is...>) {
+    size_t built = 0;
+    try {
+      ((::new (Address<Is>()) ElementType<Is>(other.template get<Is>()),
+        ++built),
+       ...);
+    } catch (...) {
+      DestroyFirst(built);
+      throw;
+    }
+  }
+
+  template <size_t... Is>
+  void MoveFrom(PackedTupleStorage&& other, std::index_sequence<Is...>) {
+    size_t built = 0;
+    try {
+      ((::new (Address<Is>())
+            ElementType<Is>(std::move(other.template get<Is>())),
+        ++built),
+       ...);
+    } catch (...) {
+      DestroyFirst(built);
+      throw;
+    }
+  }
+
+  template <size_t... Is>
+  void Assign(const PackedTupleStorage& other, std::index_sequence<Is...>) {
+    ((get<Is>() = other.template get<Is>()), ...);
+  }
+
+  template <size_t... Is>
+  void MoveAssign(PackedTupleStorage&& other, std::index_sequence<Is...>) {
+    ((get<Is>() = std::move(other.template get<Is>())), ...);
+  }
+
+  // Destroys elements [0, count) in reverse order.
+  void DestroyFirst(size_t count) { DestroyFirst(count, Indices{}); }
+
+ private:
+  template <size_t I>
+  void* Address() {
+    return static_cast<void*>(m_storage + Layout::kOffsets[I]);
+  }
+
+  template <size_t I>
+  static void DestroyAt(PackedTupleStorage& self) {
+    self.get<I>().~ElementType<I>();
+  }
+
+  template <size_t... Is>
+  void DestroyFirst(size_t count, std::index_sequence<Is...>) {
+    if constexpr (sizeof...(Is) > 0) {
+      using Destroy = void (*)(PackedTupleStorage&);
+      constexpr Destroy kDestroy[] = {&DestroyAt<Is>...};
+      while (count > 0)
+        kDestroy[--count](*this);
+    }
+  }
+
+  alignas(Layout::kMaxAlign) unsigned char m_storage[Layout::kPackedSize];
+};
+
+template <typename... Ts>
+struct PackedTupleIsTrivial
+    : std::integral_constant<
+          bool,
+          (std::is_trivially_copy_constructible<Ts>::value && ...) &&
+              (std::is_trivially_move_constructible<Ts>::value && ...) &&
+              (std::is_trivially_copy_assignable<Ts>::value && ...) &&
+              (std::is_trivially_move_assignable<Ts>::value && ...) &&
+              (std::is_trivially_destructible<Ts>::value && ...)> {};
+
+// Trivial elements: the implicit copy/move/destructor are trivial.
+template <bool Trivial, typename... Ts>
+class PackedTupleBase : public PackedTupleStorage<Ts...> {
+ protected:
+  using PackedTupleStorage<Ts...>::PackedTupleStorage;
+};
+
+template <typename... Ts>
+class PackedTupleBase<false, Ts...> : public PackedTupleStorage<Ts...> {
+  using Storage = PackedTupleStorage<Ts...>;
+  using Indices = typename Storage::Indices;
+
+ public:
+  PackedTupleBase() = default;
+
+  PackedTupleBase(const PackedTupleBase& other) noexcept(
+      (std::is_nothrow_copy_constructible<Ts>::value && ...))
+      : Storage(typename Storage::Uninitialized{}) {
+    this->CopyFrom(other, Indices{});
+  }
+
+  PackedTupleBase(PackedTupleBase&& other) noexcept(
+      (std::is_nothrow_move_constructible<Ts>::value && ...))
+      : Storage(typename Storage::Uninitialized{}) {
+    this->MoveFrom(std::move(other), Indices{});
+  }
+
+  PackedTupleBase& operator=(const PackedTupleBase& other) noexcept(
+      (std::is_nothrow_copy_assignable<Ts>::value && ...)) {
+    this->Assign(other, Indices{});
+    return *this;
+  }
+
+  PackedTupleBase& operator=(PackedTupleBase&& other) noexcept(
+      (std::is_nothrow_move_assignable<Ts>::value && ...)) {
+    this->MoveAssign(std::move(other), Indices{});
+    return *this;
+  }
+
+  ~PackedTupleBase() { this->DestroyFirst(sizeof...(Ts)); }
+
+ protected:
+  using Storage::Storage;
+};
+
+template <typename... Ts>
+class PackedTuple
+    : public PackedTupleBase<PackedTupleIsTrivial<Ts...>::value, Ts...> {
+  using Base = PackedTupleBase<PackedTupleIsTrivial<Ts...>::value, Ts...>;
+
+ public:
+  PackedTuple() = default;
+
+  template <typename... Args,
+            typename = typename std::enable_if<
+                sizeof...(Args) == sizeof...(Ts) && (sizeof...(Args) > 0) &&
+                !std::is_same<std::tuple<typename std::decay<Args>::type...>,
+                              std::tuple<PackedTuple>>::value>::type>
+  PackedTuple(Args&&... args)
+      : Base(typename Base::FromValues{}, std::forward<Args>(args)...) {}
+};
+
+template <size_t I, typename... Ts>
+auto get(PackedTuple<Ts...>& t) ->
+    typename PackedTuple<Ts...>::template ElementType<I>& {
+  return t.template get<I>();
+}
+
+template <size_t I, typename... Ts>
+auto get(const PackedTuple<Ts...>& t) ->
+    const typename PackedTuple<Ts...>::template ElementType<I>& {
+  return t.template get<I>();
+}
+
+// 3. Build a PackedTuple from a TypeList (see ExtractReturnAndArgs.h).
+
+template <typename List>
+struct PackedTupleFromListImpl;
+
+template <typename... Ts>
+struct PackedTupleFromListImpl<TypeList<Ts...>> {
+  using Type = PackedTuple<Ts...>;
+};
+
+template <typename List>
+using PackedTupleFromList = typename PackedTupleFromListImpl<List>::Type;
+
+// ###############################################################################
+
+namespace NS_PackedTuple {
+
+using RecordLayout = PackedLayout<char, double, short, int, char>;
+
+static_assert(RecordLayout::kDeclaredSize == 32, "char pads up to double");
+static_assert(RecordLayout::kPackedSize == 16,
+              "double, int, short, char, char");
+static_assert(RecordLayout::kBytesSaved == 16, "padding removed");
+static_assert(RecordLayout::kOrder[0] == 1 && RecordLayout::kOffsets[1] == 0,
+              "double is stored first");
+static_assert(sizeof(PackedTuple<char, double, short, int, char>) == 16,
+              "sizeof matches the layout report");
+static_assert(sizeof(PackedTupleFromList<TypeList<char, int, char>>) == 8,
+              "PackedTuple from a TypeList");
+
+using TrivialRecord = PackedTuple<char, double, int>;
+static_assert(std::is_trivially_copyable<TrivialRecord>::value &&
+                  std::is_trivially_destructible<TrivialRecord>::value,
+              "trivial elements keep the tuple trivial");
+static_assert(IsTriviallyRelocatable<TrivialRecord>::value,
+              "RelocatableVector moves it with realloc");
+static_assert(
+    std::is_nothrow_move_constructible<PackedTuple<std::string, int>>::value,
+    "std::vector growth moves instead of copying");
+static_assert(!std::is_trivially_copyable<PackedTuple<std::string>>::value,
+              "std::string is copied element by element");
+
+// Counts live instances; the copy after |copies_before_throw| copies throws
+// (never while it is negative).
+struct Tracked {
+  static int live;
+  static int copies_before_throw;
+
+  Tracked() { ++live; }
+  Tracked(const Tracked&) {
+    if (copies_before_throw >= 0 && copies_before_throw-- == 0)
+      throw std::runtime_error("copy");
+    ++live;
+  }
+  ~Tracked() { --live; }
+};
+
+inline int Tracked::live = 0;
+inline int Tracked::copies_before_throw = -1;
+
+struct ThrowOnInt {
+  ThrowOnInt() = default;
+  explicit ThrowOnInt(int) { throw std::runtime_error("construct"); }
+};
+
+}  // namespace NS_PackedTuple
+
+TEST(PackedTuple, PackedTuple) {
+  PackedTuple<char, double, std::string, int> t('a', 1.5, "packed", 7);
+  ASSERT_EQ(t.get<0>(), 'a');
+  ASSERT_EQ(t.get<1>(), 1.5);
+  ASSERT_EQ(t.get<2>(), "packed");
+  ASSERT_EQ(get<3>(t), 7);
+
+  PackedTuple<char, double, std::string, int> copy = t;
+  copy.get<2>() += " copy";
+  ASSERT_EQ(copy.get<2>(), "packed copy");
+  ASSERT_EQ(t.get<2>(), "packed");
+
+  PackedTuple<char, double, std::string, int> moved = std::move(copy);
+  ASSERT_EQ(moved.get<2>(), "packed copy");
+
+  using namespace NS_PackedTuple;
+
+  TrivialRecord trivial('b', 2.5, 3);
+  TrivialRecord trivial_copy = trivial;
+  ASSERT_EQ(trivial_copy.get<1>(), 2.5);
+
+  // An element constructor that throws part-way destroys the elements
+  // already built.
+  {
+    using Throwing = PackedTuple<Tracked, ThrowOnInt>;
+    ASSERT_THROW(Throwing(Tracked(), 1), std::runtime_error);
+    ASSERT_EQ(Tracked::live, 0);
+
+    using Pair = PackedTuple<Tracked, Tracked>;
+    Pair pair;
+    ASSERT_EQ(Tracked::live, 2);
+    Tracked::copies_before_throw = 1;
+    ASSERT_THROW(Pair{pair}, std::runtime_error);
+    ASSERT_EQ(Tracked::live, 2);
+  }
+  ASSERT_EQ(Tracked::live, 0);
+
+  PrintPackedLayout<char, double, short, int, char>();
+}
+
+// ###############################################################################
+
+// Benchmark: memory footprint and field access cost against std::tuple.
+// Disabled by default, run with --gtest_also_run_disabled_tests.
+
+namespace NS_PackedTuple {
+
+template <typename Record, size_t I, size_t J>
+void BenchRecords(const wchar_t* name, size_t count) {
+  std::vector<Record> records(count);
+  for (size_t i = 0; i < count; ++i) {
+    get<I>(records[i]) = static_cast<double>(i);
+    get<J>(records[i]) = static_cast<int>(i);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  double sum = 0;
+  for (int pass = 0; pass < 10; ++pass) {
+    for (const Record& r : records)
+      sum += get<I>(r) + get<J>(r);
+  }
+  auto stop = std::chrono::steady_clock::now();
+
+  std::wcout << std::left << std::setw(12) << name << std::right
+             << L" sizeof = " << std::setw(3) << sizeof(Record)
+             << L" footprint = " << std::setw(10)
+             << sizeof(Record) * count / 1024 << L" KiB  10 scans = "
+             << std::setw(8)
+             << std::chrono::duration<double, std::milli>(stop - start).count()
+             << L" ms (checksum " << sum << L")" << std::endl;
+}
+
+}  // namespace NS_PackedTuple
+
+TEST(PackedTuple, DISABLED_Benchmark) {
+  using namespace NS_PackedTuple;
+
+  const size_t kCount = 1 << 22;
+  std::wcout << std::fixed << std::setprecision(3);
+  BenchRecords<std::tuple<char, double, short, int, char>, 1, 3>(
+      L"std::tuple", kCount);
+  BenchRecords<PackedTuple<char, double, short, int, char>, 1, 3>(
+      L"PackedTuple", kCount);
+}
@@ -0,0 +1,546 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "DefaultArgs.h"
+
+// Lock-free bounded queues on top of Array<ElementType, Size>.
+
+// The capacity is a template argument, so it must be a power of two: a
+// position is mapped to its slot with |pos & (Size - 1)| instead of a modulo,
+// and the positions themselves just keep counting up (size_t wrap-around is
+// harmless because only differences of positions are compared).
+
+// Indices written by different threads live on different cache lines, so a
+// producer bumping the tail does not invalidate the line the consumer polls
+// (false sharing).
+
+constexpr size_t kCacheLineSize = 64;
+
+template <size_t Size>
+struct IsPowerOfTwo {
+  static constexpr bool value = Size != 0 && (Size & (Size - 1)) == 0;
+};
+
+// 1. SpscRingBuffer: one producer thread, one consumer thread.
+
+// Each side keeps a private copy of the other side's index and only reloads
+// the shared atomic when the copy says the buffer is full (producer) or
+// empty (consumer). In steady state a push touches no cache line owned by
+// the consumer.
+
+template <typename T, size_t Size>
+class SpscRingBuffer {
+ public:
+  static_assert(IsPowerOfTwo<Size>::value,
+                "SpscRingBuffer size must be a power of two");
+
+  static constexpr size_t capacity() { return Size; }
+
+  template <typename U>
+  bool TryPush(U&& value) {
+    const size_t tail = m_tail.load(std::memory_order_relaxed);
+    if (tail - m_cached_head == Size) {
+      m_cached_head = m_head.load(std::memory_order_acquire);
+      if (tail - m_cached_head == Size)
+        return false;
+    }
+    m_slots[tail & kMask] = std::forward<U>(value);
+    m_tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool TryPop(T& out) {
+    const size_t head = m_head.load(std::memory_order_relaxed);
+    if (head == m_cached_tail) {
+      m_cached_tail = m_tail.load(std::memory_order_acquire);
+      if (head == m_cached_tail)
+        return false;
+    }
+    out = std::move(m_slots[head & kMask]);
+    m_head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Pushes up to |count| items with a single release store, returns the
+  // number pushed.
+  size_t TryPushBatch(const T* items, size_t count) {
+    const size_t tail = m_tail.load(std::memory_order_relaxed);
+    if (Size - (tail - m_cached_head) < count)
+      m_cached_head = m_head.load(std::memory_order_acquire);
+    const size_t n = std::min(count, Size - (tail - m_cached_head));
+    for (size_t i = 0; i < n; ++i)
+      m_slots[(tail + i) & kMask] = items[i];
+    if (n)
+      m_tail.store(tail + n, std::memory_order_release);
+    return n;
+  }
+
+  // Pops up to |count| items into |out|, returns the number popped.
+  size_t TryPopBatch(T* out, size_t count) {
+    const size_t head = m_head.load(std::memory_order_relaxed);
+    if (m_cached_tail - head < count)
+      m_cached_tail = m_tail.load(std::memory_order_acquire);
+    const size_t n = std::min(count, m_cached_tail - head);
+    for (size_t i = 0; i < n; ++i)
+      out[i] = std::move(m_slots[(head + i) & kMask]);
+    if (n)
+      m_head.store(head + n, std::memory_order_release);
+    return n;
+  }
+
+ private:
+  static constexpr size_t kMask = Size - 1;
+
+  // Consumer side.
+  alignas(kCacheLineSize) std::atomic<size_t> m_head{0};
+  size_t m_cached_tail = 0;
+
+  // Producer side.
+  alignas(kCacheLineSize) std::atomic<size_t> m_tail{0};
+  size_t m_cached_head = 0;
+
+  alignas(kCacheLineSize) Array<T, Size> m_slots{};
+};
+
+// 2. MpmcRingBuffer: any number of producers and consumers.
+
+// Every slot carries a sequence number telling which lap it is ready for:
+// sequence == pos means the slot at position |pos| is free for a producer,
+// sequence == pos + 1 means it holds the value for a consumer. A thread
+// claims a position with a CAS on the shared index, then publishes the slot
+// by bumping its sequence; nobody waits on a lock.
+
+template <typename T, size_t Size>
+class MpmcRingBuffer {
+ public:
+  static_assert(IsPowerOfTwo<Size>::value,
+                "MpmcRingBuffer size must be a power of two");
+
+  static constexpr size_t capacity() { return Size; }
+
+  MpmcRingBuffer() {
+    for (size_t i = 0; i < Size; ++i)
+      m_slots[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  MpmcRingBuffer(const MpmcRingBuffer&) = delete;
+  MpmcRingBuffer& operator=(const MpmcRingBuffer&) = delete;
+
+  template <typename U>
+  bool TryPush(U&& value) {
+    const size_t pos = Claim(m_enqueue_pos, 0, 1);
+    if (pos == kNoPosition)
+      return false;
+    Slot& slot = m_slots[pos & kMask];
+    slot.value = std::forward<U>(value);
+    slot.sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool TryPop(T& out) {
+    const size_t pos = Claim(m_dequeue_pos, 1, 1);
+    if (pos == kNoPosition)
+      return false;
+    Slot& slot = m_slots[pos & kMask];
+    out = std::move(slot.value);
+    slot.sequence.store(pos + Size, std::memory_order_release);
+    return true;
+  }
+
+  // Claims as many consecutive free slots as are ready (up to |count|) with a
+  // single CAS, returns the number pushed.
+  size_t TryPushBatch(const T* items, size_t count) {
+    size_t n = count;
+    const size_t pos = ClaimBatch(m_enqueue_pos, 0, n);
+    for (size_t i = 0; i < n; ++i) {
+      Slot& slot = m_slots[(pos + i) & kMask];
+      slot.value = items[i];
+      slot.sequence.store(pos + i + 1, std::memory_order_release);
+    }
+    return n;
+  }
+
+  // Claims as many consecutive filled slots as are ready (up to |count|)
+  // with a single CAS, returns the number popped.
+  size_t TryPopBatch(T* out, size_t count) {
+    size_t n = count;
+    const size_t pos = ClaimBatch(m_dequeue_pos, 1, n);
+    for (size_t i = 0; i < n; ++i) {
+      Slot& slot = m_slots[(pos + i) & kMask];
+      out[i] = std::move(slot.value);
+      slot.sequence.store(pos + i + Size, std::memory_order_release);
+    }
+    return n;
+  }
+
+ private:
+  static constexpr size_t kMask = Size - 1;
+  static constexpr size_t kNoPosition = static_cast<size_t>(-1);
+
+  struct Slot {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  // Distance between the sequence of the slot at |pos| and the sequence it
+  // must have to be claimed: 0 = ready, < 0 = not ready yet (full for a
+  // producer, empty for a consumer), > 0 = another thread claimed it first.
+  intptr_t Distance(size_t pos, size_t lap_offset) const {
+    const size_t sequence =
+        m_slots[pos & kMask].sequence.load(std::memory_order_acquire);
+    return static_cast<intptr_t>(sequence - (pos + lap_offset));
+  }
+
+  size_t Claim(std::atomic<size_t>& index, size_t lap_offset, size_t count) {
+    size_t n = count;
+    const size_t pos = ClaimBatch(index, lap_offset, n);
+    return n ? pos : kNoPosition;
+  }
+
+  // On return |count| holds the number of positions claimed starting at the
+  // returned position.
+  size_t ClaimBatch(std::atomic<size_t>& index,
+                    size_t lap_offset,
+                    size_t& count) {
+    size_t pos = index.load(std::memory_order_relaxed);
+    if (count == 0)
+      return pos;
+    for (;;) {
+      const intptr_t distance = Distance(pos, lap_offset);
+      if (distance < 0) {
+        count = 0;
+        return pos;
+      }
+      if (distance > 0) {
+        pos = index.load(std::memory_order_relaxed);
+        continue;
+      }
+      // Slots are claimed in order, so the ready run starting at |pos| is
+      // ours if nobody moved |index| in the meantime.
+      size_t n = 1;
+      while (n < count && Distance(pos + n, lap_offset) == 0)
+        ++n;
+      if (index.compare_exchange_weak(pos, pos + n,
+                                      std::memory_order_relaxed)) {
+        count = n;
+        return pos;
+      }
+    }
+  }
+
+  alignas(kCacheLineSize) std::atomic<size_t> m_enqueue_pos{0};
+  alignas(kCacheLineSize) std::atomic<size_t> m_dequeue_pos{0};
+  alignas(kCacheLineSize) Array<Slot, Size> m_slots;
+};
+
+// ###############################################################################
+
+TEST(RingBuffer, SpscRingBuffer) {
+  static_assert(IsPowerOfTwo<8>::value && !IsPowerOfTwo<10>::value,
+                "power of two");
+
+  SpscRingBuffer<int, 8> queue;
+  int value = 0;
+  ASSERT_FALSE(queue.TryPop(value));
+  for (int i = 0; i < 8; ++i)
+    ASSERT_TRUE(queue.TryPush(i));
+  ASSERT_FALSE(queue.TryPush(8));
+  ASSERT_TRUE(queue.TryPop(value));
+  ASSERT_EQ(value, 0);
+
+  int batch[8] = {};
+  ASSERT_EQ(queue.TryPopBatch(batch, 8), 7u);
+  ASSERT_EQ(batch[6], 7);
+
+  const int items[5] = {10, 11, 12, 13, 14};
+  ASSERT_EQ(queue.TryPushBatch(items, 5), 5u);
+  ASSERT_EQ(queue.TryPushBatch(items, 5), 3u);
+  ASSERT_EQ(queue.TryPopBatch(batch, 8), 8u);
+  ASSERT_EQ(batch[0], 10);
+  ASSERT_EQ(batch[7], 12);
+
+  // One producer thread, one consumer thread: every value arrives once and in
+  // order. The producer pushes in batches and the consumer pops one at a
+  // time, then the other way round, so both index caches are exercised.
+  SpscRingBuffer<size_t, 16> shared;
+  const size_t kCount = 100000;
+  size_t sum = 0;
+  size_t expected = 0;
+  std::thread producer([&] {
+    size_t items[5];
+    for (size_t i = 0; i < kCount;) {
+      const size_t n = std::min<size_t>(5, kCount - i);
+      for (size_t k = 0; k < n; ++k)
+        items[k] = i + k;
+      size_t pushed = 0;
+      while (pushed < n) {
+        const size_t m = shared.TryPushBatch(items + pushed, n - pushed);
+        if (!m)
+          std::this_thread::yield();
+        pushed += m;
+      }
+      i += n;
+    }
+    for (size_t i = kCount; i < 2 * kCount; ++i) {
+      while (!shared.TryPush(i))
+        std::this_thread::yield();
+    }
+  });
+  size_t x = 0;
+  while (expected < kCount) {
+    if (!shared.TryPop(x)) {
+      std::this_thread::yield();
+      continue;
+    }
+    ASSERT_EQ(x, expected++);
+    sum += x;
+  }
+  size_t out[7];
+  while (expected < 2 * kCount) {
+    const size_t m = shared.TryPopBatch(out, 7);
+    if (!m)
+      std::this_thread::yield();
+    for (size_t k = 0; k < m; ++k) {
+      ASSERT_EQ(out[k], expected++);
+      sum += out[k];
+    }
+  }
+  producer.join();
+  ASSERT_EQ(sum, 2 * kCount * (2 * kCount - 1) / 2);
+}
+
+TEST(RingBuffer, MpmcRingBuffer) {
+  MpmcRingBuffer<int, 8> queue;
+  int value = 0;
+  ASSERT_FALSE(queue.TryPop(value));
+  for (int i = 0; i < 8; ++i)
+    ASSERT_TRUE(queue.TryPush(i));
+  ASSERT_FALSE(queue.TryPush(8));
+  ASSERT_TRUE(queue.TryPop(value));
+  ASSERT_EQ(value, 0);
+
+  int batch[8] = {};
+  ASSERT_EQ(queue.TryPopBatch(batch, 8), 7u);
+  ASSERT_EQ(batch[6], 7);
+
+  const int items[5] = {10, 11, 12, 13, 14};
+  ASSERT_EQ(queue.TryPushBatch(items, 5), 5u);
+  ASSERT_EQ(queue.TryPushBatch(items, 5), 3u);
+  ASSERT_EQ(queue.TryPopBatch(batch, 8), 8u);
+  ASSERT_EQ(batch[5], 10);
+
+  // Every value pushed by 4 producers is popped exactly once by 4 consumers.
+  MpmcRingBuffer<size_t, 64> shared;
+  const size_t kPerProducer = 10000;
+  std::atomic<size_t> popped{0};
+  std::atomic<size_t> sum{0};
+  std::vector<std::thread> threads;
+  for (size_t p = 0; p < 4; ++p) {
+    threads.emplace_back([&] {
+      for (size_t i = 1; i <= kPerProducer; ++i) {
+        while (!shared.TryPush(i))
+          std::this_thread::yield();
+      }
+    });
+  }
+  for (size_t c = 0; c < 4; ++c) {
+    threads.emplace_back([&] {
+      size_t x = 0;
+      while (popped.load() < 4 * kPerProducer) {
+        if (shared.TryPop(x)) {
+          sum += x;
+          ++popped;
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  for (std::thread& t : threads)
+    t.join();
+  ASSERT_EQ(sum.load(), 4 * kPerProducer * (kPerProducer + 1) / 2);
+}
+
+// ###############################################################################
+
+// Benchmark: throughput across symmetric (n/n) and asymmetric (4/1, 1/4)
+// producer/consumer mixes and SPSC round-trip latency, against a
+// mutex-guarded std::deque.
+// Disabled by default, run with --gtest_also_run_disabled_tests.
+
+namespace NS_RingBuffer {
+
+constexpr size_t kQueueSize = 1024;
+constexpr size_t kBatchSize = 32;
+
+template <size_t Size>
+class MutexDeque {
+ public:
+  bool TryPush(size_t value) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_items.size() == Size)
+      return false;
+    m_items.push_back(value);
+    return true;
+  }
+
+  bool TryPop(size_t& out) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_items.empty())
+      return false;
+    out = m_items.front();
+    m_items.pop_front();
+    return true;
+  }
+
+ private:
+  std::mutex m_mutex;
+  std::deque<size_t> m_items;
+};
+
+// Returns million items per second.
+template <typename Queue>
+double BenchThroughput(size_t producers, size_t consumers, size_t total) {
+  Queue queue;
+  std::atomic<size_t> popped{0};
+  std::vector<std::thread> threads;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t p = 0; p < producers; ++p) {
+    threads.emplace_back([&, p] {
+      for (size_t i = p; i < total; i += producers) {
+        while (!queue.TryPush(i))
+          std::this_thread::yield();
+      }
+    });
+  }
+  for (size_t c = 0; c < consumers; ++c) {
+    threads.emplace_back([&] {
+      size_t x = 0;
+      while (popped.load(std::memory_order_relaxed) < total) {
+        if (queue.TryPop(x))
+          popped.fetch_add(1, std::memory_order_relaxed);
+        else
+          std::this_thread::yield();
+      }
+    });
+  }
+  for (std::thread& t : threads)
+    t.join();
+  auto stop = std::chrono::steady_clock::now();
+  return total /
+         std::chrono::duration<double, std::micro>(stop - start).count();
+}
+
+template <typename Queue>
+double BenchBatchThroughput(size_t total) {
+  Queue queue;
+  auto start = std::chrono::steady_clock::now();
+  std::thread producer([&] {
+    size_t items[kBatchSize];
+    for (size_t i = 0; i < total;) {
+      const size_t n = std::min(kBatchSize, total - i);
+      for (size_t k = 0; k < n; ++k)
+        items[k] = i + k;
+      size_t pushed = 0;
+      while (pushed < n) {
+        const size_t m = queue.TryPushBatch(items + pushed, n - pushed);
+        if (!m)
+          std::this_thread::yield();
+        pushed += m;
+      }
+      i += n;
+    }
+  });
+  size_t out[kBatchSize];
+  for (size_t popped = 0; popped < total;) {
+    const size_t m = queue.TryPopBatch(out, kBatchSize);
+    if (!m)
+      std::this_thread::yield();
+    popped += m;
+  }
+  producer.join();
+  auto stop = std::chrono::steady_clock::now();
+  return total /
+         std::chrono::duration<double, std::micro>(stop - start).count();
+}
+
+// Mean round trip through a pair of queues, in microseconds.
+template <typename Queue>
+double BenchRoundTrip(size_t iterations) {
+  Queue ping;
+  Queue pong;
+  std::thread echo([&] {
+    size_t x = 0;
+    for (size_t i = 0; i < iterations; ++i) {
+      while (!ping.TryPop(x))
+        std::this_thread::yield();
+      while (!pong.TryPush(x))
+        std::this_thread::yield();
+    }
+  });
+  auto start = std::chrono::steady_clock::now();
+  size_t x = 0;
+  for (size_t i = 0; i < iterations; ++i) {
+    while (!ping.TryPush(i))
+      std::this_thread::yield();
+    while (!pong.TryPop(x))
+      std::this_thread::yield();
+  }
+  auto stop = std::chrono::steady_clock::now();
+  echo.join();
+  return std::chrono::duration<double, std::micro>(stop - start).count() /
+         iterations;
+}
+
+}  // namespace NS_RingBuffer
+
+TEST(RingBuffer, DISABLED_Benchmark) {
+  using namespace NS_RingBuffer;
+  using Spsc = SpscRingBuffer<size_t, kQueueSize>;
+  using Mpmc = MpmcRingBuffer<size_t, kQueueSize>;
+  using Locked = MutexDeque<kQueueSize>;
+
+  const size_t kTotal = 1 << 18;
+  std::wcout << std::fixed << std::setprecision(3);
+  std::wcout << L"SPSC 1/1          " << std::setw(9)
+             << BenchThroughput<Spsc>(1, 1, kTotal) << L" Mitems/s"
+             << std::endl;
+  std::wcout << L"SPSC 1/1 batch    " << std::setw(9)
+             << BenchBatchThroughput<Spsc>(kTotal) << L" Mitems/s"
+             << std::endl;
+  std::wcout << L"MPMC 1/1 batch    " << std::setw(9)
+             << BenchBatchThroughput<Mpmc>(kTotal) << L" Mitems/s"
+             << std::endl;
+  // Producers/consumers. Many-to-one and one-to-many load one end of the
+  // queue far more than the other.
+  const size_t kMixes[][2] = {{1, 1}, {2, 2}, {4, 4}, {4, 1}, {1, 4}};
+  for (const size_t* mix : kMixes) {
+    std::wcout << L"MPMC " << mix[0] << L"/" << mix[1] << L"          "
+               << std::setw(9) << BenchThroughput<Mpmc>(mix[0], mix[1], kTotal)
+               << L" Mitems/s" << std::endl;
+    std::wcout << L"mutex+deque " << mix[0] << L"/" << mix[1] << L"   "
+               << std::setw(9)
+               << BenchThroughput<Locked>(mix[0], mix[1], kTotal)
+               << L" Mitems/s" << std::endl;
+  }
+
+  const size_t kRoundTrips = 10000;
+  std::wcout << L"round trip SPSC   " << std::setw(9)
+             << BenchRoundTrip<Spsc>(kRoundTrips) << L" us" << std::endl;
+  std::wcout << L"round trip MPMC   " << std::setw(9)
+             << BenchRoundTrip<Mpmc>(kRoundTrips) << L" us" << std::endl;
+  std::wcout << L"round trip mutex  " << std::setw(9)
+             << BenchRoundTrip<Locked>(kRoundTrips) << L" us" << std::endl;
+}
@@ -0,0 +1,546 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+#include "VariadicTemplate.h"
+
+// Hierarchical timing wheel for delayed and repeating callbacks.
+
+// Time is counted in ticks (1 ms by default). The wheel has kLevels levels
+// of kSlots slots each; level k covers delays below kSlots^(k + 1) ticks with
+// a granularity of kSlots^k ticks. A timer goes into the slot of its expiry
+// tick at the lowest level that can hold its delay. Each time the level-0
+// index wraps around, the current slot of level 1 is cascaded (its timers are
+// re-inserted closer to their expiry), and so on up the levels.
+//   * Schedule() and Cancel() are O(1): slots are intrusive doubly linked
+//     lists of timer nodes, nodes are recycled through a free list.
+//   * RunExpired() detaches a whole slot in one splice and runs the batch.
+//     If a callback throws, its timer is dropped (even a repeating one) and
+//     the exception propagates; the rest of the batch stays detached and runs
+//     first on the next RunExpired().
+// The wheel reads time from a Clock object with a Now() member; tests pass a
+// SimulatedTimerClock and move time by hand.
+
+class SteadyTimerClock {
+ public:
+  using TimePoint = std::chrono::steady_clock::time_point;
+
+  TimePoint Now() const { return std::chrono::steady_clock::now(); }
+};
+
+class SimulatedTimerClock {
+ public:
+  using TimePoint = std::chrono::steady_clock::time_point;
+
+  TimePoint Now() const { return m_now; }
+  void Advance(std::chrono::nanoseconds delta) { m_now += delta; }
+
+ private:
+  TimePoint m_now{};
+};
+
+// 0 is never a valid id.
+using TimerId = uint64_t;
+
+template <typename Clock = SteadyTimerClock>
+class TimingWheel {
+ public:
+  using Callback = std::function<void()>;
+
+  static constexpr size_t kSlotBits = 8;
+  static constexpr size_t kSlots = size_t{1} << kSlotBits;
+  static constexpr size_t kLevels = 4;
+
+  explicit TimingWheel(
+      Clock& clock,
+      std::chrono::nanoseconds tick = std::chrono::milliseconds(1))
+      : m_clock(clock), m_tick(tick), m_start(clock.Now()) {
+    // One sentinel per slot plus one for the batch being run.
+    m_nodes.resize(kSentinels);
+    for (uint32_t i = 0; i < kSentinels; ++i) {
+      m_nodes[i].prev = i;
+      m_nodes[i].next = i;
+    }
+  }
+
+  TimingWheel(const TimingWheel&) = delete;
+  TimingWheel& operator=(const TimingWheel&) = delete;
+
+  // Pre-allocates nodes for |count| pending timers.
+  void Reserve(size_t count) { m_nodes.reserve(kSentinels + count); }
+
+  // Runs |callback| once, |delay| from now (rounded up to a whole tick; a
+  // delay <= 0 runs it on the next tick).
+  TimerId Schedule(std::chrono::nanoseconds delay, Callback callback) {
+    return Add(delay, 0, std::move(callback));
+  }
+
+  // Runs |callback| every |period|, the first time |period| from now. A
+  // period <= 0 runs it every tick.
+  TimerId ScheduleRepeating(std::chrono::nanoseconds period,
+                            Callback callback) {
+    return Add(period, ToTicks(period), std::move(callback));
+  }
+
+  // Returns false if the timer already ran (once), was cancelled, or |id| is
+  // unknown. A repeating timer may cancel itself from its own callback.
+  bool Cancel(TimerId id) {
+    const uint32_t index = static_cast<uint32_t>(id);
+    if (index < kSentinels || index >= m_nodes.size())
+      return false;
+    Node& node = m_nodes[index];
+    if (node.generation != static_cast<uint32_t>(id >> 32))
+      return false;
+    if (node.state == kPending) {
+      Unlink(index);
+      Release(index);
+      return true;
+    }
+    if (node.state == kFiring) {
+      node.state = kCancelled;
+      return true;
+    }
+    return false;
+  }
+
+  // Moves the wheel up to the clock's current tick and runs every timer that
+  // expired on the way, returns how many callbacks ran.
+  size_t RunExpired() {
+    const uint64_t target = CurrentTick();
+    // Left over by a callback which threw in the previous call.
+    size_t fired = RunBatch();
+    while (m_now < target) {
+      if (m_pending == 0) {
+        m_now = target;
+        break;
+      }
+      ++m_now;
+      for (size_t level = 1; level < kLevels; ++level) {
+        if ((m_now & LevelMask(level - 1)) != 0)
+          break;
+        Cascade(level);
+      }
+      fired += RunSlot(SlotSentinel(0, m_now & (kSlots - 1)));
+    }
+    return fired;
+  }
+
+  size_t size() const { return m_pending; }
+
+ private:
+  enum State : uint8_t { kFree, kPending, kFiring, kCancelled };
+
+  static constexpr uint32_t kSentinels = kLevels * kSlots + 1;
+  static constexpr uint32_t kBatch = kLevels * kSlots;
+  static constexpr uint32_t kNone = static_cast<uint32_t>(-1);
+
+  struct Node {
+    uint32_t prev = 0;
+    uint32_t next = 0;
+    uint32_t generation = 1;
+    State state = kFree;
+    uint64_t expiry = 0;
+    uint64_t period = 0;
+    Callback callback;
+  };
+
+  // Mask of the tick bits below |level + 1|: level 0 -> 0xFF, 1 -> 0xFFFF...
+  static constexpr uint64_t LevelMask(size_t level) {
+    return (uint64_t{1} << (kSlotBits * (level + 1))) - 1;
+  }
+
+  static constexpr uint32_t SlotSentinel(size_t level, uint64_t slot) {
+    return static_cast<uint32_t>(level * kSlots + slot);
+  }
+
+  // Rounds up to whole ticks, at least one: a delay <= 0 means "next tick".
+  // Computed as quotient plus remainder so nanoseconds::max() cannot overflow.
+  uint64_t ToTicks(std::chrono::nanoseconds delay) const {
+    if (delay <= std::chrono::nanoseconds::zero())
+      return 1;
+    const uint64_t ticks = static_cast<uint64_t>(delay / m_tick);
+    return delay % m_tick == std::chrono::nanoseconds::zero() ? ticks
+                                                              : ticks + 1;
+  }
+
+  // Expiries saturate: a timer at the maximum tick never fires.
+  static uint64_t AddTicks(uint64_t tick, uint64_t ticks) {
+    return ticks > std::numeric_limits<uint64_t>::max() - tick
+               ? std::numeric_limits<uint64_t>::max()
+               : tick + ticks;
+  }
+
+  uint64_t CurrentTick() const {
+    return static_cast<uint64_t>((m_clock.Now() - m_start) / m_tick);
+  }
+
+  TimerId Add(std::chrono::nanoseconds delay,
+              uint64_t period,
+              Callback callback) {
+    uint32_t index = m_free;
+    if (index != kNone) {
+      m_free = m_nodes[index].next;
+    } else {
+      index = static_cast<uint32_t>(m_nodes.size());
+      m_nodes.emplace_back();
+    }
+    Node& node = m_nodes[index];
+    node.state = kPending;
+    node.expiry = AddTicks(std::max(CurrentTick(), m_now), ToTicks(delay));
+    node.period = period;
+    node.callback = std::move(callback);
+    Insert(index);
+    ++m_pending;
+    return (static_cast<uint64_t>(node.generation) << 32) | index;
+  }
+
+  // Links a pending node into the slot matching its expiry.
+  void Insert(uint32_t index) {
+    const uint64_t expiry = m_nodes[index].expiry;
+    const uint64_t delta = expiry > m_now ? expiry - m_now : 0;
+    size_t level = 0;
+    while (level + 1 < kLevels && delta > LevelMask(level))
+      ++level;
+    // Beyond the top level: park in the farthest slot, RunSlot() re-inserts.
+    const uint64_t slot_tick =
+        delta > LevelMask(level) ? m_now + LevelMask(level) : expiry;
+    const uint64_t slot = (slot_tick >> (kSlotBits * level)) & (kSlots - 1);
+    LinkBefore(SlotSentinel(level, slot), index);
+  }
+
+  void LinkBefore(uint32_t sentinel, uint32_t index) {
+    Node& node = m_nodes[index];
+    node.prev = m_nodes[sentinel].prev;
+    node.next = sentinel;
+    m_nodes[node.prev].next = index;
+    m_nodes[sentinel].prev = index;
+  }
+
+  void Unlink(uint32_t index) {
+    Node& node = m_nodes[index];
+    m_nodes[node.prev].next = node.next;
+    m_nodes[node.next].prev = node.prev;
+  }
+
+  // Moves every node of list |from| to the (empty) list |to| in O(1).
+  void Splice(uint32_t from, uint32_t to) {
+    if (m_nodes[from].next == from)
+      return;
+    m_nodes[to].next = m_nodes[from].next;
+    m_nodes[to].prev = m_nodes[from].prev;
+    m_nodes[m_nodes[to].next].prev = to;
+    m_nodes[m_nodes[to].prev].next = to;
+    m_nodes[from].next = from;
+    m_nodes[from].prev = from;
+  }
+
+  void Release(uint32_t index) {
+    Node& node = m_nodes[index];
+    node.callback = nullptr;
+    node.state = kFree;
+    ++node.generation;
+    node.next = m_free;
+    m_free = index;
+    --m_pending;
+  }
+
+  void Cascade(size_t level) {
+    const uint32_t sentinel = SlotSentinel(
+        level, (m_now >> (kSlotBits * level)) & (kSlots - 1));
+    while (m_nodes[sentinel].next != sentinel) {
+      const uint32_t index = m_nodes[sentinel].next;
+      Unlink(index);
+      Insert(index);
+    }
+  }
+
+  size_t RunSlot(uint32_t sentinel) {
+    Splice(sentinel, kBatch);
+    return RunBatch();
+  }
+
+  size_t RunBatch() {
+    size_t fired = 0;
+    // Callbacks may schedule or cancel timers, including ones still in the
+    // batch, so the batch is consumed from its head one node at a time.
+    while (m_nodes[kBatch].next != kBatch) {
+      const uint32_t index = m_nodes[kBatch].next;
+      Unlink(index);
+      if (m_nodes[index].expiry > m_now) {
+        Insert(index);
+        continue;
+      }
+      m_nodes[index].state = kFiring;
+      // |m_nodes| may reallocate while the callback schedules timers.
+      Callback callback = std::move(m_nodes[index].callback);
+      try {
+        callback();
+      } catch (...) {
+        // The rest of the batch stays linked to kBatch for the next call.
+        Release(index);
+        throw;
+      }
+      ++fired;
+      Node& node = m_nodes[index];
+      if (node.state == kFiring && node.period != 0) {
+        node.state = kPending;
+        node.expiry = std::max(AddTicks(node.expiry, node.period), m_now + 1);
+        node.callback = std::move(callback);
+        Insert(index);
+      } else {
+        Release(index);
+      }
+    }
+    return fired;
+  }
+
+  Clock& m_clock;
+  const std::chrono::nanoseconds m_tick;
+  const typename Clock::TimePoint m_start;
+
+  std::vector<Node> m_nodes;
+  uint32_t m_free = kNone;
+  uint64_t m_now = 0;
+  size_t m_pending = 0;
+};
+
+// ###############################################################################
+
+TEST(TimingWheel, TimingWheel) {
+  using std::chrono::milliseconds;
+
+  SimulatedTimerClock clock;
+  TimingWheel<SimulatedTimerClock> wheel(clock);
+  std::vector<int> fired;
+
+  wheel.Schedule(milliseconds(5), [&] { fired.push_back(5); });
+  const TimerId cancelled =
+      wheel.Schedule(milliseconds(7), [&] { fired.push_back(7); });
+  // Far enough to go through two cascades.
+  wheel.Schedule(milliseconds(70000), [&] { fired.push_back(70000); });
+  ASSERT_EQ(wheel.size(), 3u);
+
+  clock.Advance(milliseconds(4));
+  ASSERT_EQ(wheel.RunExpired(), 0u);
+  clock.Advance(milliseconds(1));
+  ASSERT_EQ(wheel.RunExpired(), 1u);
+  ASSERT_TRUE(wheel.Cancel(cancelled));
+  ASSERT_FALSE(wheel.Cancel(cancelled));
+
+  clock.Advance(milliseconds(69994));
+  ASSERT_EQ(wheel.RunExpired(), 0u);
+  clock.Advance(milliseconds(1));
+  ASSERT_EQ(wheel.RunExpired(), 1u);
+  ASSERT_EQ(fired, (std::vector<int>{5, 70000}));
+  ASSERT_EQ(wheel.size(), 0u);
+
+  // A repeating timer which cancels itself on its third run.
+  int runs = 0;
+  TimerId repeating = 0;
+  repeating = wheel.ScheduleRepeating(milliseconds(10), [&] {
+    if (++runs == 3)
+      wheel.Cancel(repeating);
+  });
+  clock.Advance(milliseconds(100));
+  ASSERT_EQ(wheel.RunExpired(), 3u);
+  ASSERT_EQ(runs, 3);
+  ASSERT_EQ(wheel.size(), 0u);
+
+  // Bound member function closures from BindFunction().
+  MemObj mem_obj;
+  std::function<bool(MemObj&)> mem_func_bind =
+      BindFunction(&MemObj::MemFunc, true, 1, 1.0f, 1.0);
+  wheel.Schedule(milliseconds(1), [&] { mem_func_bind(mem_obj); });
+  clock.Advance(milliseconds(1));
+  ASSERT_EQ(wheel.RunExpired(), 1u);
+
+  // Non-positive delays and periods fire on the next tick.
+  int negative = 0;
+  wheel.Schedule(milliseconds(-5), [&] { ++negative; });
+  const TimerId every_tick =
+      wheel.ScheduleRepeating(milliseconds(0), [&] { ++negative; });
+  clock.Advance(milliseconds(1));
+  ASSERT_EQ(wheel.RunExpired(), 2u);
+  clock.Advance(milliseconds(3));
+  ASSERT_EQ(wheel.RunExpired(), 3u);
+  ASSERT_TRUE(wheel.Cancel(every_tick));
+  ASSERT_EQ(negative, 5);
+
+  // The largest delay saturates instead of wrapping around to a near expiry.
+  const TimerId never = wheel.Schedule(std::chrono::nanoseconds::max(), [] {});
+  const TimerId never_repeating =
+      wheel.ScheduleRepeating(std::chrono::nanoseconds::max(), [] {});
+  clock.Advance(std::chrono::hours(1));
+  ASSERT_EQ(wheel.RunExpired(), 0u);
+  ASSERT_EQ(wheel.size(), 2u);
+  ASSERT_TRUE(wheel.Cancel(never));
+  ASSERT_TRUE(wheel.Cancel(never_repeating));
+}
+
+TEST(TimingWheel, ThrowingCallback) {
+  using std::chrono::milliseconds;
+
+  SimulatedTimerClock clock;
+  TimingWheel<SimulatedTimerClock> wheel(clock);
+  std::vector<int> fired;
+
+  // Three timers on the same tick, the middle one throws.
+  wheel.Schedule(milliseconds(5), [&] { fired.push_back(1); });
+  const TimerId throwing = wheel.ScheduleRepeating(milliseconds(5), [&] {
+    fired.push_back(2);
+    throw std::runtime_error("timer");
+  });
+  wheel.Schedule(milliseconds(5), [&] { fired.push_back(3); });
+  wheel.Schedule(milliseconds(6), [&] { fired.push_back(4); });
+  clock.Advance(milliseconds(5));
+  ASSERT_THROW(wheel.RunExpired(), std::runtime_error);
+  ASSERT_EQ(fired, (std::vector<int>{1, 2}));
+  // The throwing timer is dropped, repeating or not.
+  ASSERT_FALSE(wheel.Cancel(throwing));
+  ASSERT_EQ(wheel.size(), 2u);
+
+  // The rest of the interrupted batch runs on the next call, before the
+  // following ticks.
+  ASSERT_EQ(wheel.RunExpired(), 1u);
+  ASSERT_EQ(fired, (std::vector<int>{1, 2, 3}));
+  clock.Advance(milliseconds(1));
+  ASSERT_EQ(wheel.RunExpired(), 1u);
+  ASSERT_EQ(fired, (std::vector<int>{1, 2, 3, 4}));
+  ASSERT_EQ(wheel.size(), 0u);
+
+  // A timer left over in the batch can still be cancelled.
+  wheel.Schedule(milliseconds(1), [] { throw std::runtime_error("timer"); });
+  const TimerId left_over = wheel.Schedule(milliseconds(1), [&] {
+    fired.push_back(5);
+  });
+  clock.Advance(milliseconds(1));
+  ASSERT_THROW(wheel.RunExpired(), std::runtime_error);
+  ASSERT_TRUE(wheel.Cancel(left_over));
+  ASSERT_EQ(wheel.RunExpired(), 0u);
+  ASSERT_EQ(wheel.size(), 0u);
+  ASSERT_EQ(fired.size(), 4u);
+}
+
+// ###############################################################################
+
+// Benchmark: insert / cancel / expire rates with 10^6 and 10^7 pending timers,
+// most of them cancelled before they fire, against a std::priority_queue with
+// lazy cancellation.
+// Disabled by default, run with --gtest_also_run_disabled_tests.
+
+namespace NS_TimingWheel {
+
+constexpr int kMaxDelayMs = 60000;
+
+struct Rates {
+  double insert;
+  double cancel;
+  double expire;
+};
+
+template <typename Func>
+double OpsPerSecond(size_t ops, Func&& func) {
+  auto start = std::chrono::steady_clock::now();
+  func();
+  auto stop = std::chrono::steady_clock::now();
+  return ops / std::chrono::duration<double>(stop - start).count();
+}
+
+inline Rates BenchWheel(const std::vector<int>& delays, size_t& sink) {
+  SimulatedTimerClock clock;
+  TimingWheel<SimulatedTimerClock> wheel(clock);
+  wheel.Reserve(delays.size());
+  std::vector<TimerId> ids(delays.size());
+  Rates rates;
+  rates.insert = OpsPerSecond(delays.size(), [&] {
+    for (size_t i = 0; i < delays.size(); ++i)
+      ids[i] = wheel.Schedule(std::chrono::milliseconds(delays[i]),
+                              [&sink] { ++sink; });
+  });
+  // Cancel 9 out of 10.
+  const size_t cancels = delays.size() - delays.size() / 10;
+  rates.cancel = OpsPerSecond(cancels, [&] {
+    for (size_t i = 0; i < delays.size(); ++i) {
+      if (i % 10 != 0)
+        wheel.Cancel(ids[i]);
+    }
+  });
+  rates.expire = OpsPerSecond(delays.size() - cancels, [&] {
+    clock.Advance(std::chrono::milliseconds(kMaxDelayMs));
+    wheel.RunExpired();
+  });
+  return rates;
+}
+
+inline Rates BenchPriorityQueue(const std::vector<int>& delays, size_t& sink) {
+  using Entry = std::pair<uint64_t, uint32_t>;  // expiry, timer index.
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+  std::vector<std::function<void()>> callbacks(delays.size());
+  std::vector<bool> cancelled(delays.size(), false);
+  Rates rates;
+  rates.insert = OpsPerSecond(delays.size(), [&] {
+    for (size_t i = 0; i < delays.size(); ++i) {
+      callbacks[i] = [&sink] { ++sink; };
+      queue.emplace(delays[i], static_cast<uint32_t>(i));
+    }
+  });
+  const size_t cancels = delays.size() - delays.size() / 10;
+  rates.cancel = OpsPerSecond(cancels, [&] {
+    for (size_t i = 0; i < delays.size(); ++i) {
+      if (i % 10 != 0) {
+        cancelled[i] = true;
+        callbacks[i] = nullptr;
+      }
+    }
+  });
+  // Cancelled entries are only dropped when they reach the top.
+  rates.expire = OpsPerSecond(delays.size() - cancels, [&] {
+    while (!queue.empty() && queue.top().first <= kMaxDelayMs) {
+      const uint32_t index = queue.top().second;
+      queue.pop();
+      if (!cancelled[index])
+        callbacks[index]();
+    }
+  });
+  return rates;
+}
+
+inline void PrintRates(const wchar_t* name, size_t count, const Rates& r) {
+  std::wcout << std::left << std::setw(16) << name << std::right
+             << std::setw(9) << count << L" timers: insert " << std::setw(7)
+             << r.insert / 1e6 << L" M/s, cancel " << std::setw(7)
+             << r.cancel / 1e6 << L" M/s, expire " << std::setw(7)
+             << r.expire / 1e6 << L" M/s" << std::endl;
+}
+
+}  // namespace NS_TimingWheel
+
+TEST(TimingWheel, DISABLED_Benchmark) {
+  using namespace NS_TimingWheel;
+
+  std::mt19937 random(42);
+  std::uniform_int_distribution<int> delay(1, kMaxDelayMs);
+  size_t sink = 0;
+  std::wcout << std::fixed << std::setprecision(2);
+  for (size_t count : {size_t{1000000}, size_t{10000000}}) {
+    std::vector<int> delays(count);
+    for (int& d : delays)
+      d = delay(random);
+    PrintRates(L"TimingWheel", count, BenchWheel(delays, sink));
+    PrintRates(L"priority_queue", count, BenchPriorityQueue(delays, sink));
+  }
+  ASSERT_EQ(sink, 2 * (1000000 / 10 + 10000000 / 10));
+}
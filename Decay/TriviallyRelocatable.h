@@ -0,0 +1,475 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Trivial relocation.
+
+// Relocating an object means moving it to a new address and ending the
+// lifetime of the old one (move-construct + destroy). For many types this
+// pair of operations is equivalent to copying the bytes and forgetting the
+// source, so a container may relocate a whole range with one memcpy/realloc
+// instead of looping over move constructors and destructors.
+
+// 1. IsTriviallyRelocatable<T>: trivially copyable types are detected
+// automatically, other types opt in by specialization.
+
+template <typename T>
+struct IsTriviallyRelocatable {
+  static constexpr bool value = std::is_trivially_copyable<T>::value;
+};
+
+#define DECLARE_TRIVIALLY_RELOCATABLE(type) \
+  template <>                               \
+  struct IsTriviallyRelocatable<type> {     \
+    static constexpr bool value = true;     \
+  };
+
+// std::unique_ptr only holds a pointer (and an empty deleter), moving it never
+// depends on its own address.
+template <typename T>
+struct IsTriviallyRelocatable<std::unique_ptr<T>> {
+  static constexpr bool value = true;
+};
+
+// Note: std::string is NOT opted in. libstdc++ stores a pointer to its own
+// small buffer, so a bitwise copy of a short string would point into the old
+// object. Opt it in only on standard libraries known to be safe.
+
+// 2. RelocatableVector<T>: a growable array which relocates its elements with
+// realloc/memmove when IsTriviallyRelocatable<T>::value is true, and falls
+// back to element-wise move + destroy otherwise.
+
+template <typename T>
+class RelocatableVector {
+ public:
+  using value_type = T;
+  using size_type = size_t;
+  using iterator = T*;
+  using const_iterator = const T*;
+
+  static constexpr bool kTriviallyRelocatable =
+      IsTriviallyRelocatable<T>::value;
+
+  // Storage comes from malloc/realloc, so over-aligned types are not
+  // supported.
+  static_assert(alignof(T) <= alignof(std::max_align_t),
+                "RelocatableVector does not support over-aligned types");
+
+  RelocatableVector() = default;
+
+  // Delegates to the default constructor, so if an element copy throws the
+  // destructor frees the elements already copied and the buffer.
+  RelocatableVector(const RelocatableVector& other) : RelocatableVector() {
+    reserve(other.m_size);
+    for (const T& x : other)
+      emplace_back(x);
+  }
+
+  RelocatableVector(RelocatableVector&& other) noexcept
+      : m_data(other.m_data),
+        m_size(other.m_size),
+        m_capacity(other.m_capacity) {
+    other.m_data = nullptr;
+    other.m_size = 0;
+    other.m_capacity = 0;
+  }
+
+  RelocatableVector& operator=(RelocatableVector other) noexcept {
+    swap(other);
+    return *this;
+  }
+
+  ~RelocatableVector() {
+    clear();
+    std::free(m_data);
+  }
+
+  void swap(RelocatableVector& other) noexcept {
+    std::swap(m_data, other.m_data);
+    std::swap(m_size, other.m_size);
+    std::swap(m_capacity, other.m_capacity);
+  }
+
+  T* data() { return m_data; }
+  const T* data() const { return m_data; }
+  size_t size() const { return m_size; }
+  size_t capacity() const { return m_capacity; }
+  bool empty() const { return m_size == 0; }
+
+  T& operator[](size_t i) { return m_data[i]; }
+  const T& operator[](size_t i) const { return m_data[i]; }
+  T& back() { return m_data[m_size - 1]; }
+
+  iterator begin() { return m_data; }
+  iterator end() { return m_data + m_size; }
+  const_iterator begin() const { return m_data; }
+  const_iterator end() const { return m_data + m_size; }
+
+  void reserve(size_t new_capacity) {
+    if (new_capacity > m_capacity)
+      Reallocate(new_capacity);
+  }
+
+  void clear() {
+    if constexpr (!std::is_trivially_destructible<T>::value) {
+      for (size_t i = 0; i < m_size; ++i)
+        m_data[i].~T();
+    }
+    m_size = 0;
+  }
+
+  void push_back(const T& value) { emplace_back(value); }
+  void push_back(T&& value) { emplace_back(std::move(value)); }
+
+  template <typename... Args>
+  T& emplace_back(Args&&... args) {
+    if (m_size == m_capacity) {
+      // |args| may refer to an element of this vector, build the value before
+      // the storage moves.
+      T tmp(std::forward<Args>(args)...);
+      Reallocate(NextCapacity());
+      ::new (static_cast<void*>(m_data + m_size)) T(std::move(tmp));
+    } else {
+      ::new (static_cast<void*>(m_data + m_size))
+          T(std::forward<Args>(args)...);
+    }
+    return m_data[m_size++];
+  }
+
+  void pop_back() {
+    --m_size;
+    m_data[m_size].~T();
+  }
+
+  iterator insert(const_iterator pos, const T& value) {
+    return emplace(pos, value);
+  }
+
+  iterator insert(const_iterator pos, T&& value) {
+    return emplace(pos, std::move(value));
+  }
+
+  template <typename... Args>
+  iterator emplace(const_iterator pos, Args&&... args) {
+    const size_t index = static_cast<size_t>(pos - m_data);
+    if (index == m_size) {
+      emplace_back(std::forward<Args>(args)...);
+      return m_data + index;
+    }
+
+    T tmp(std::forward<Args>(args)...);
+    if (m_size == m_capacity)
+      Reallocate(NextCapacity());
+
+    T* slot = m_data + index;
+    if constexpr (kTriviallyRelocatable) {
+      // Shift the tail up by one slot in a single memmove, |slot| is then raw
+      // storage.
+      std::memmove(static_cast<void*>(slot + 1), static_cast<void*>(slot),
+                   (m_size - index) * sizeof(T));
+      try {
+        ::new (static_cast<void*>(slot)) T(std::move(tmp));
+      } catch (...) {
+        std::memmove(static_cast<void*>(slot), static_cast<void*>(slot + 1),
+                     (m_size - index) * sizeof(T));
+        throw;
+      }
+      ++m_size;
+    } else {
+      ::new (static_cast<void*>(m_data + m_size))
+          T(std::move(m_data[m_size - 1]));
+      // The new last element is live from here on: count it before a move
+      // below can throw, so the destructor still destroys it.
+      ++m_size;
+      std::move_backward(slot, m_data + m_size - 2, m_data + m_size - 1);
+      *slot = std::move(tmp);
+    }
+    return slot;
+  }
+
+  iterator erase(const_iterator pos) {
+    const size_t index = static_cast<size_t>(pos - m_data);
+    T* slot = m_data + index;
+    if constexpr (kTriviallyRelocatable) {
+      slot->~T();
+      std::memmove(static_cast<void*>(slot), static_cast<void*>(slot + 1),
+                   (m_size - index - 1) * sizeof(T));
+    } else {
+      std::move(slot + 1, m_data + m_size, slot);
+      m_data[m_size - 1].~T();
+    }
+    --m_size;
+    return slot;
+  }
+
+ private:
+  static constexpr size_t kMaxSize = static_cast<size_t>(-1) / sizeof(T);
+
+  size_t NextCapacity() const {
+    if (m_capacity == 0)
+      return 4;
+    if (m_capacity == kMaxSize)
+      throw std::length_error("RelocatableVector: capacity too large");
+    return m_capacity > kMaxSize / 2 ? kMaxSize : m_capacity * 2;
+  }
+
+  void Reallocate(size_t new_capacity) {
+    if (new_capacity > kMaxSize)
+      throw std::length_error("RelocatableVector: capacity too large");
+    if constexpr (kTriviallyRelocatable) {
+      // realloc may extend the block in place, otherwise it copies the bytes,
+      // either way no constructor or destructor runs.
+      void* p =
+          std::realloc(static_cast<void*>(m_data), new_capacity * sizeof(T));
+      if (!p)
+        throw std::bad_alloc();
+      m_data = static_cast<T*>(p);
+    } else {
+      // Build the new array first; if a copy throws, drop it and leave the
+      // old one untouched. Types which cannot throw on move are moved.
+      T* p = static_cast<T*>(std::malloc(new_capacity * sizeof(T)));
+      if (!p)
+        throw std::bad_alloc();
+      size_t built = 0;
+      try {
+        for (; built < m_size; ++built) {
+          ::new (static_cast<void*>(p + built))
+              T(std::move_if_noexcept(m_data[built]));
+        }
+      } catch (...) {
+        for (size_t i = 0; i < built; ++i)
+          p[i].~T();
+        std::free(p);
+        throw;
+      }
+      for (size_t i = 0; i < m_size; ++i)
+        m_data[i].~T();
+      std::free(m_data);
+      m_data = p;
+    }
+    m_capacity = new_capacity;
+  }
+
+  T* m_data = nullptr;
+  size_t m_size = 0;
+  size_t m_capacity = 0;
+};
+
+// ###############################################################################
+
+namespace NS_TriviallyRelocatable {
+
+struct SmallRecord {
+  int id;
+  float weight;
+  double score;
+};
+
+// Not trivially copyable (user-provided copy), but relocatable by memcpy.
+struct OptedInRecord {
+  OptedInRecord() = default;
+  OptedInRecord(const OptedInRecord& other) : value(other.value) {}
+  int value = 0;
+};
+
+// Tracks the addresses of live instances; the copy (construction or
+// assignment) after |copies_before_throw| copies throws (never while it is
+// negative). No move operations, so the vector copies.
+struct ThrowingCopy {
+  static std::set<const ThrowingCopy*> alive;
+  static int copies_before_throw;
+
+  explicit ThrowingCopy(int value) : value(value) { alive.insert(this); }
+  ThrowingCopy(const ThrowingCopy& other) : value(other.value) {
+    if (copies_before_throw >= 0 && copies_before_throw-- == 0)
+      throw std::runtime_error("copy");
+    alive.insert(this);
+  }
+  ThrowingCopy& operator=(const ThrowingCopy& other) {
+    if (copies_before_throw >= 0 && copies_before_throw-- == 0)
+      throw std::runtime_error("copy");
+    value = other.value;
+    return *this;
+  }
+  ~ThrowingCopy() { alive.erase(this); }
+
+  int value;
+};
+
+inline std::set<const ThrowingCopy*> ThrowingCopy::alive;
+inline int ThrowingCopy::copies_before_throw = -1;
+
+}  // namespace NS_TriviallyRelocatable
+
+DECLARE_TRIVIALLY_RELOCATABLE(NS_TriviallyRelocatable::OptedInRecord)
+
+TEST(TriviallyRelocatable, Trait) {
+  using namespace NS_TriviallyRelocatable;
+
+  ASSERT_TRUE(IsTriviallyRelocatable<int>::value);
+  ASSERT_TRUE(IsTriviallyRelocatable<SmallRecord>::value);
+  ASSERT_TRUE(IsTriviallyRelocatable<OptedInRecord>::value);
+  ASSERT_TRUE(IsTriviallyRelocatable<std::unique_ptr<int>>::value);
+  ASSERT_FALSE(IsTriviallyRelocatable<std::string>::value);
+  ASSERT_FALSE(IsTriviallyRelocatable<std::vector<int>>::value);
+}
+
+TEST(TriviallyRelocatable, RelocatableVector) {
+  RelocatableVector<std::unique_ptr<int>> ptrs;
+  for (int i = 0; i < 100; ++i)
+    ptrs.push_back(std::make_unique<int>(i));
+  ptrs.insert(ptrs.begin() + 50, std::make_unique<int>(-1));
+  ASSERT_EQ(ptrs.size(), 101u);
+  ASSERT_EQ(*ptrs[49], 49);
+  ASSERT_EQ(*ptrs[50], -1);
+  ASSERT_EQ(*ptrs[51], 50);
+  ptrs.erase(ptrs.begin() + 50);
+  for (int i = 0; i < 100; ++i)
+    ASSERT_EQ(*ptrs[i], i);
+
+  RelocatableVector<std::string> strings;
+  for (int i = 0; i < 100; ++i)
+    strings.push_back(std::to_string(i));
+  strings.insert(strings.begin(), std::string("first"));
+  strings.push_back(strings[0]);
+  ASSERT_EQ(strings[0], "first");
+  ASSERT_EQ(strings[1], "0");
+  ASSERT_EQ(strings.back(), "first");
+  strings.erase(strings.begin());
+  ASSERT_EQ(strings[0], "0");
+  ASSERT_EQ(strings.size(), 101u);
+
+  RelocatableVector<std::string> copy = strings;
+  ASSERT_EQ(copy.size(), strings.size());
+  ASSERT_EQ(copy[99], "99");
+}
+
+TEST(TriviallyRelocatable, ExceptionSafety) {
+  using namespace NS_TriviallyRelocatable;
+
+  {
+    RelocatableVector<ThrowingCopy> values;
+    for (int i = 0; i < 4; ++i)
+      values.emplace_back(i);
+    ASSERT_EQ(ThrowingCopy::alive.size(), 4u);
+
+    // Growth copies each element; the third copy throws and the original
+    // elements must still be alive.
+    ThrowingCopy::copies_before_throw = 2;
+    ASSERT_THROW(values.reserve(8), std::runtime_error);
+    ASSERT_EQ(ThrowingCopy::alive.size(), 4u);
+    ASSERT_EQ(values.capacity(), 4u);
+    for (int i = 0; i < 4; ++i) {
+      ASSERT_EQ(ThrowingCopy::alive.count(&values[i]), 1u);
+      ASSERT_EQ(values[i].value, i);
+    }
+
+    ThrowingCopy::copies_before_throw = 2;
+    ASSERT_THROW(RelocatableVector<ThrowingCopy> copy(values),
+                 std::runtime_error);
+    ASSERT_EQ(ThrowingCopy::alive.size(), 4u);
+
+    ThrowingCopy::copies_before_throw = -1;
+    values.reserve(8);
+    ASSERT_EQ(values.capacity(), 8u);
+    ASSERT_EQ(values[3].value, 3);
+
+    // insert() copies the value, copy-constructs the new last element, then
+    // shifts by assignment; the first assignment throws. The new last
+    // element must belong to the vector, not leak.
+    ThrowingCopy::copies_before_throw = 2;
+    ASSERT_THROW(values.insert(values.begin(), values[0]), std::runtime_error);
+    ThrowingCopy::copies_before_throw = -1;
+    ASSERT_EQ(ThrowingCopy::alive.size(), values.size());
+  }
+  ASSERT_TRUE(ThrowingCopy::alive.empty());
+
+  // Capacities whose byte size overflows size_t are rejected.
+  RelocatableVector<uint64_t> words;
+  ASSERT_THROW(words.reserve(static_cast<size_t>(-1) / 8 + 2),
+               std::length_error);
+  ASSERT_EQ(words.capacity(), 0u);
+  words.push_back(1);
+  ASSERT_EQ(words[0], 1u);
+}
+
+// ###############################################################################
+
+// Benchmark: push_back growth and middle insert against std::vector.
+// Disabled by default, run with --gtest_also_run_disabled_tests.
+
+namespace NS_TriviallyRelocatable {
+
+template <typename Func>
+double MeasureMs(Func&& func) {
+  auto start = std::chrono::steady_clock::now();
+  func();
+  auto stop = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(stop - start).count();
+}
+
+template <typename Vector, typename MakeValue>
+double BenchPushBack(size_t count, MakeValue make_value) {
+  return MeasureMs([&] {
+    Vector v;
+    for (size_t i = 0; i < count; ++i)
+      v.push_back(make_value(i));
+  });
+}
+
+template <typename Vector, typename MakeValue>
+double BenchMiddleInsert(size_t count, MakeValue make_value) {
+  return MeasureMs([&] {
+    Vector v;
+    for (size_t i = 0; i < count; ++i)
+      v.insert(v.begin() + v.size() / 2, make_value(i));
+  });
+}
+
+template <typename T, typename MakeValue>
+void BenchType(const wchar_t* name, MakeValue make_value) {
+  const size_t kPushCount = 1 << 20;
+  const size_t kInsertCount = 1 << 13;
+  std::wcout << std::left << std::setw(22) << name << std::right
+             << L" push_back: std::vector " << std::setw(8)
+             << BenchPushBack<std::vector<T>>(kPushCount, make_value)
+             << L" ms, RelocatableVector " << std::setw(8)
+             << BenchPushBack<RelocatableVector<T>>(kPushCount, make_value)
+             << L" ms | middle insert: std::vector " << std::setw(8)
+             << BenchMiddleInsert<std::vector<T>>(kInsertCount, make_value)
+             << L" ms, RelocatableVector " << std::setw(8)
+             << BenchMiddleInsert<RelocatableVector<T>>(kInsertCount,
+                                                        make_value)
+             << L" ms" << std::endl;
+}
+
+}  // namespace NS_TriviallyRelocatable
+
+TEST(TriviallyRelocatable, DISABLED_Benchmark) {
+  using namespace NS_TriviallyRelocatable;
+
+  std::wcout << std::fixed << std::setprecision(3);
+  BenchType<SmallRecord>(L"SmallRecord", [](size_t i) {
+    return SmallRecord{static_cast<int>(i), 1.0f, 2.0};
+  });
+  BenchType<std::unique_ptr<int>>(L"std::unique_ptr<int>", [](size_t i) {
+    return std::make_unique<int>(static_cast<int>(i));
+  });
+  BenchType<std::string>(L"std::string", [](size_t i) {
+    return std::string("a string long enough to allocate #") +
+           std::to_string(i);
+  });
+}
@@ -0,0 +1,34 @@
+// The type index registry, see TypeIndex.h. Linked into exactly one module so
+// that every module of the program shares it.
+
+#include "TypeIndex.h"
+
+#include <mutex>
+#include <typeindex>
+#include <unordered_map>
+
+namespace {
+
+class TypeIndexRegistry {
+ public:
+  size_t IndexOf(const std::type_info& type) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_indices.find(std::type_index(type));
+    if (it != m_indices.end())
+      return it->second;
+    const size_t index = m_indices.size();
+    m_indices.emplace(std::type_index(type), index);
+    return index;
+  }
+
+ private:
+  std::mutex m_mutex;
+  std::unordered_map<std::type_index, size_t> m_indices;
+};
+
+}  // namespace
+
+size_t TypeIndexOf(const std::type_info& type) {
+  static TypeIndexRegistry registry;
+  return registry.IndexOf(type);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <typeinfo>
+
+// TypeIndex<T>(): dense index (0, 1, 2, ...) per type.
+
+// The index is cached in a function-local static per type. Template statics
+// are instantiated in every shared library that uses them, so the counter
+// alone would hand out different indices for the same type in different
+// modules. Indices are therefore assigned by one registry keyed by
+// std::type_index, behind TypeIndexOf(): each module asks once per type and
+// caches the answer.
+
+// TypeIndexOf() is defined out of line in TypeIndex.cpp, so that the program
+// has a single registry; link TypeIndex.cpp into exactly one module. When
+// several DLLs use TypeIndex.h, build the one holding TypeIndex.cpp with
+// DECAY_TYPEINDEX_EXPORTS and the others with DECAY_TYPEINDEX_IMPORTS. On ELF
+// platforms the symbol has default visibility, so shared objects resolve it
+// to the same definition even when built with -fvisibility=hidden.
+
+// The key must be the type itself, not typeid(T).name(): types in anonymous
+// namespaces of different translation units, and local classes on MSVC, can
+// have the same name while being different types.
+
+#if defined(_WIN32) && defined(DECAY_TYPEINDEX_EXPORTS)
+#define DECAY_TYPEINDEX_API __declspec(dllexport)
+#elif defined(_WIN32) && defined(DECAY_TYPEINDEX_IMPORTS)
+#define DECAY_TYPEINDEX_API __declspec(dllimport)
+#elif defined(__GNUC__)
+#define DECAY_TYPEINDEX_API __attribute__((visibility("default")))
+#else
+#define DECAY_TYPEINDEX_API
+#endif
+
+// Returns the index of |type|, assigning the next free one on first use.
+// Thread-safe.
+DECAY_TYPEINDEX_API size_t TypeIndexOf(const std::type_info& type);
+
+template <typename T>
+size_t TypeIndex() {
+  static const size_t index = TypeIndexOf(typeid(T));
+  return index;
+}
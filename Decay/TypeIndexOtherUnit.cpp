@@ -0,0 +1,21 @@
+// Second translation unit for TEST(TypeMap, TypeIndexAcrossUnits): declares a
+// type whose name is the same as one in TypeMap.h but which is a distinct type,
+// because it lives in an anonymous namespace.
+
+#include "TypeIndex.h"
+
+namespace NS_TypeMap {
+
+namespace {
+
+struct UnitLocal {
+  double value;
+};
+
+}  // namespace
+
+size_t UnitLocalTypeIndexInOtherUnit() {
+  return TypeIndex<UnitLocal>();
+}
+
+}  // namespace NS_TypeMap
@@ -0,0 +1,383 @@
+#pragma once
+
+#include <any>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <typeindex>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "TypeIndex.h"
+
+// Type-indexed heterogeneous map.
+
+// Every type used as a key gets a dense index (0, 1, 2, ...) from TypeIndex.h
+// the first time it is seen, so a value is found with one array index instead
+// of hashing a std::type_index and following an unordered_map bucket chain.
+
+// One value per type, stored inline when small.
+
+// Slots live in fixed-size chunks which are never moved or freed while the
+// map is alive, so readers need no lock: a lookup loads the chunk pointer,
+// then the slot state. Values up to kInlineSize bytes are constructed in the
+// slot itself, larger ones on the heap.
+
+// Emplace() is first-writer-wins: concurrent calls for the same type construct
+// one value and every caller gets a reference to it. If that constructor
+// throws, the exception goes to its caller and one of the waiting callers
+// constructs the value with its own arguments.
+
+class TypeMap {
+ public:
+  static constexpr size_t kInlineSize = 32;
+  static constexpr size_t kChunkSize = 64;
+  static constexpr size_t kMaxChunks = 256;
+
+  TypeMap() {
+    for (std::atomic<Chunk*>& chunk : m_chunks)
+      chunk.store(nullptr, std::memory_order_relaxed);
+  }
+
+  TypeMap(const TypeMap&) = delete;
+  TypeMap& operator=(const TypeMap&) = delete;
+
+  ~TypeMap() {
+    for (std::atomic<Chunk*>& entry : m_chunks) {
+      Chunk* chunk = entry.load(std::memory_order_relaxed);
+      if (!chunk)
+        continue;
+      for (Slot& slot : chunk->slots) {
+        if (slot.state.load(std::memory_order_relaxed) == kReady)
+          slot.destroy(slot.buffer);
+      }
+      delete chunk;
+    }
+  }
+
+  template <typename T>
+  T* Get() {
+    Slot* slot = FindSlot(TypeIndex<T>());
+    if (!slot || slot->state.load(std::memory_order_acquire) != kReady)
+      return nullptr;
+    return Storage<T>::Get(slot->buffer);
+  }
+
+  template <typename T>
+  bool Contains() {
+    return Get<T>() != nullptr;
+  }
+
+  template <typename T, typename... Args>
+  T& Emplace(Args&&... args) {
+    Slot& slot = GetOrCreateSlot(TypeIndex<T>());
+    for (;;) {
+      int expected = kEmpty;
+      if (slot.state.compare_exchange_strong(expected, kConstructing,
+                                             std::memory_order_acquire)) {
+        try {
+          Storage<T>::Construct(slot.buffer, std::forward<Args>(args)...);
+        } catch (...) {
+          slot.state.store(kEmpty, std::memory_order_release);
+          throw;
+        }
+        slot.destroy = &Storage<T>::Destroy;
+        slot.state.store(kReady, std::memory_order_release);
+        break;
+      }
+      // Another thread is constructing. If its constructor throws, the slot
+      // goes back to kEmpty and this thread tries to construct instead.
+      while (expected == kConstructing) {
+        std::this_thread::yield();
+        expected = slot.state.load(std::memory_order_acquire);
+      }
+      if (expected == kReady)
+        break;
+    }
+    return *Storage<T>::Get(slot.buffer);
+  }
+
+ private:
+  enum State { kEmpty, kConstructing, kReady };
+
+  struct Slot {
+    std::atomic<int> state{kEmpty};
+    void (*destroy)(unsigned char*) = nullptr;
+    alignas(std::max_align_t) unsigned char buffer[kInlineSize];
+  };
+
+  struct Chunk {
+    Slot slots[kChunkSize];
+  };
+
+  template <typename T,
+            bool Inline = sizeof(T) <= kInlineSize &&
+                          alignof(T) <= alignof(std::max_align_t)>
+  struct Storage {
+    template <typename... Args>
+    static void Construct(unsigned char* buffer, Args&&... args) {
+      ::new (static_cast<void*>(buffer)) T(std::forward<Args>(args)...);
+    }
+    static T* Get(unsigned char* buffer) {
+      return std::launder(reinterpret_cast<T*>(buffer));
+    }
+    static void Destroy(unsigned char* buffer) { Get(buffer)->~T(); }
+  };
+
+  template <typename T>
+  struct Storage<T, false> {
+    template <typename... Args>
+    static void Construct(unsigned char* buffer, Args&&... args) {
+      ::new (static_cast<void*>(buffer)) T*(new T(std::forward<Args>(args)...));
+    }
+    static T* Get(unsigned char* buffer) {
+      return *std::launder(reinterpret_cast<T**>(buffer));
+    }
+    static void Destroy(unsigned char* buffer) { delete Get(buffer); }
+  };
+
+  Slot* FindSlot(size_t index) {
+    if (index >= kChunkSize * kMaxChunks)
+      return nullptr;
+    Chunk* chunk =
+        m_chunks[index / kChunkSize].load(std::memory_order_acquire);
+    return chunk ? &chunk->slots[index % kChunkSize] : nullptr;
+  }
+
+  Slot& GetOrCreateSlot(size_t index) {
+    if (index >= kChunkSize * kMaxChunks)
+      throw std::length_error("TypeMap: too many distinct types");
+    std::atomic<Chunk*>& entry = m_chunks[index / kChunkSize];
+    Chunk* chunk = entry.load(std::memory_order_acquire);
+    if (!chunk) {
+      Chunk* created = new Chunk;
+      if (entry.compare_exchange_strong(chunk, created,
+                                        std::memory_order_acq_rel)) {
+        chunk = created;
+      } else {
+        delete created;
+      }
+    }
+    return chunk->slots[index % kChunkSize];
+  }
+
+  std::atomic<Chunk*> m_chunks[kMaxChunks];
+};
+
+// ###############################################################################
+
+namespace NS_TypeMap {
+
+struct Config {
+  std::string name;
+  int retries;
+};
+
+struct LargeCache {
+  double values[64];
+};
+
+// Same name as the type in TypeIndexOtherUnit.cpp, but a different type.
+namespace {
+
+struct UnitLocal {
+  int value;
+};
+
+}  // namespace
+
+size_t UnitLocalTypeIndexInOtherUnit();
+
+template <int N>
+size_t LocalClassTypeIndex() {
+  struct Local {};
+  return TypeIndex<Local>();
+}
+
+}  // namespace NS_TypeMap
+
+TEST(TypeMap, TypeIndex) {
+  using namespace NS_TypeMap;
+
+  const size_t int_index = TypeIndex<int>();
+  ASSERT_EQ(TypeIndex<int>(), int_index);
+  ASSERT_NE(TypeIndex<Config>(), int_index);
+  ASSERT_NE(TypeIndex<Config>(), TypeIndex<LargeCache>());
+
+  // Local classes of different functions are different types.
+  ASSERT_NE(LocalClassTypeIndex<0>(), LocalClassTypeIndex<1>());
+  ASSERT_EQ(LocalClassTypeIndex<0>(), LocalClassTypeIndex<0>());
+}
+
+TEST(TypeMap, TypeIndexAcrossUnits) {
+  using namespace NS_TypeMap;
+
+  const size_t here = TypeIndex<UnitLocal>();
+  ASSERT_NE(UnitLocalTypeIndexInOtherUnit(), here);
+  ASSERT_EQ(TypeIndex<UnitLocal>(), here);
+
+  TypeMap map;
+  map.Emplace<UnitLocal>().value = 7;
+  ASSERT_EQ(map.Get<UnitLocal>()->value, 7);
+}
+
+TEST(TypeMap, TypeMap) {
+  using namespace NS_TypeMap;
+
+  TypeMap map;
+  ASSERT_EQ(map.Get<Config>(), nullptr);
+  map.Emplace<Config>(Config{"service", 3});
+  ASSERT_TRUE(map.Contains<Config>());
+  ASSERT_EQ(map.Get<Config>()->name, "service");
+
+  // First writer wins.
+  ASSERT_EQ(map.Emplace<Config>(Config{"other", 0}).retries, 3);
+
+  LargeCache& cache = map.Emplace<LargeCache>();
+  cache.values[63] = 2.5;
+  ASSERT_EQ(map.Get<LargeCache>()->values[63], 2.5);
+  ASSERT_FALSE(map.Contains<int>());
+
+  TypeMap shared;
+  std::vector<std::thread> threads;
+  std::atomic<int> constructed{0};
+  struct Counted {
+    explicit Counted(std::atomic<int>& counter) { ++counter; }
+  };
+  for (int i = 0; i < 8; ++i) {
+    threads.emplace_back([&] {
+      shared.Emplace<Counted>(constructed);
+      ASSERT_NE(shared.Get<Counted>(), nullptr);
+    });
+  }
+  for (std::thread& t : threads)
+    t.join();
+  ASSERT_EQ(constructed.load(), 1);
+
+  // The first constructor throws while the other threads wait in Emplace();
+  // one of them must construct the value instead.
+  TypeMap retried;
+  std::atomic<int> attempts{0};
+  std::atomic<int> entered{0};
+  std::atomic<int> failures{0};
+  std::atomic<bool> release{false};
+  struct Flaky {
+    Flaky(std::atomic<int>& attempts, std::atomic<bool>& release) {
+      if (attempts++ != 0)
+        return;
+      while (!release.load())
+        std::this_thread::yield();
+      throw std::runtime_error("first construction fails");
+    }
+  };
+  threads.clear();
+  for (int i = 0; i < 8; ++i) {
+    threads.emplace_back([&] {
+      ++entered;
+      try {
+        retried.Emplace<Flaky>(attempts, release);
+      } catch (const std::runtime_error&) {
+        ++failures;
+      }
+    });
+  }
+  while (entered.load() != 8)
+    std::this_thread::yield();
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  release = true;
+  for (std::thread& t : threads)
+    t.join();
+  ASSERT_EQ(failures.load(), 1);
+  ASSERT_EQ(attempts.load(), 2);
+  ASSERT_TRUE(retried.Contains<Flaky>());
+}
+
+// ###############################################################################
+
+// Benchmark: lookup and insert against std::unordered_map<std::type_index,
+// std::any>.
+// Disabled by default, run with --gtest_also_run_disabled_tests.
+
+namespace NS_TypeMap {
+
+template <int N>
+struct Service {
+  int value = N;
+};
+
+template <int... Ns>
+double BenchTypeMapInsert(size_t rounds) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < rounds; ++i) {
+    TypeMap map;
+    (map.Emplace<Service<Ns>>(), ...);
+  }
+  auto stop = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(stop - start).count();
+}
+
+template <int... Ns>
+double BenchAnyMapInsert(size_t rounds) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < rounds; ++i) {
+    std::unordered_map<std::type_index, std::any> map;
+    (map.emplace(std::type_index(typeid(Service<Ns>)), Service<Ns>()), ...);
+  }
+  auto stop = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(stop - start).count();
+}
+
+template <int... Ns>
+double BenchTypeMapLookup(size_t rounds, long long& sum) {
+  TypeMap map;
+  (map.Emplace<Service<Ns>>(), ...);
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < rounds; ++i)
+    sum += (map.Get<Service<Ns>>()->value + ...);
+  auto stop = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(stop - start).count();
+}
+
+template <int... Ns>
+double BenchAnyMapLookup(size_t rounds, long long& sum) {
+  std::unordered_map<std::type_index, std::any> map;
+  (map.emplace(std::type_index(typeid(Service<Ns>)), Service<Ns>()), ...);
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < rounds; ++i) {
+    sum += (std::any_cast<Service<Ns>&>(
+                map.find(std::type_index(typeid(Service<Ns>)))->second)
+                .value +
+            ...);
+  }
+  auto stop = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(stop - start).count();
+}
+
+}  // namespace NS_TypeMap
+
+TEST(TypeMap, DISABLED_Benchmark) {
+  using namespace NS_TypeMap;
+
+  const size_t kInsertRounds = 1 << 12;
+  const size_t kLookupRounds = 1 << 17;
+  long long sum = 0;
+  std::wcout << std::fixed << std::setprecision(3);
+  std::wcout << L"insert 8 types x " << kInsertRounds << L": TypeMap "
+             << BenchTypeMapInsert<0, 1, 2, 3, 4, 5, 6, 7>(kInsertRounds)
+             << L" ms, unordered_map<type_index, any> "
+             << BenchAnyMapInsert<0, 1, 2, 3, 4, 5, 6, 7>(kInsertRounds)
+             << L" ms" << std::endl;
+  std::wcout << L"lookup 8 types x " << kLookupRounds << L": TypeMap "
+             << BenchTypeMapLookup<0, 1, 2, 3, 4, 5, 6, 7>(kLookupRounds, sum)
+             << L" ms, unordered_map<type_index, any> "
+             << BenchAnyMapLookup<0, 1, 2, 3, 4, 5, 6, 7>(kLookupRounds, sum)
+             << L" ms (checksum " << sum << L")" << std::endl;
+}
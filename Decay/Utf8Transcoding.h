@@ -0,0 +1,1446 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <cwchar>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <locale>
+#include <random>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <typeinfo>
+#include <vector>
+
+// x86 builds always compile the AVX2 kernels and pick them at run time when
+// the CPU supports AVX2, so one binary runs everywhere. MSVC accepts AVX2
+// intrinsics without /arch:AVX2; GCC and Clang need the target attribute.
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || \
+    defined(__i386__)
+#define UTF8_USE_AVX2 1
+#if defined(_MSC_VER) && !defined(__clang__)
+#define UTF8_TARGET_AVX2
+#else
+#define UTF8_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define UTF8_USE_SSE2 1
+#endif
+
+#if defined(UTF8_USE_AVX2) || defined(UTF8_USE_SSE2)
+#include <immintrin.h>
+#endif
+#if defined(UTF8_USE_AVX2) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "ArrayInTemplate.h"
+#include "EnableIf.h"
+#include "MetaFunctionAndTypeTraits.h"
+#include "Specialization.h"
+#include "VariadicTemplate.h"
+
+// UTF-8 <-> wchar_t transcoding.
+
+// wchar_t is UTF-32 on Linux/macOS and UTF-16 on Windows, both are handled.
+// Text is processed in alternating modes:
+//   * ASCII runs are widened/narrowed 16 (SSE2) or 32 (AVX2) code units at a
+//     time: one movemask tells whether the whole block is ASCII, then the
+//     bytes are zero-extended (or packed back) with unpack/pack instructions.
+//   * With AVX2, mixed text is decoded 16 and encoded 8 code points at a time
+//     (DecodeAvx2, EncodeAvx2), and validated 32 bytes per step with three
+//     nibble table lookups (Keiser & Lemire, "Validating UTF-8 In Less Than
+//     One Instruction Per Byte").
+//   * 4-byte sequences (surrogate pairs in UTF-16) are decoded one at a time,
+//     as is all non-ASCII text on CPUs without AVX2.
+
+namespace utf8_internal {
+
+// Decodes one UTF-8 sequence starting at |p|, rejecting truncated sequences,
+// overlong forms, surrogates and code points above U+10FFFF.
+inline bool DecodeOne(const unsigned char* p,
+                      const unsigned char* end,
+                      char32_t& code_point,
+                      size_t& length) {
+  const unsigned char b0 = p[0];
+  if (b0 < 0x80) {
+    code_point = b0;
+    length = 1;
+    return true;
+  }
+
+  unsigned char min = 0x80;
+  unsigned char max = 0xBF;
+  if (b0 >= 0xC2 && b0 <= 0xDF) {
+    length = 2;
+    code_point = b0 & 0x1F;
+  } else if (b0 >= 0xE0 && b0 <= 0xEF) {
+    length = 3;
+    code_point = b0 & 0x0F;
+    if (b0 == 0xE0)
+      min = 0xA0;  // Overlong.
+    else if (b0 == 0xED)
+      max = 0x9F;  // Surrogates.
+  } else if (b0 >= 0xF0 && b0 <= 0xF4) {
+    length = 4;
+    code_point = b0 & 0x07;
+    if (b0 == 0xF0)
+      min = 0x90;  // Overlong.
+    else if (b0 == 0xF4)
+      max = 0x8F;  // Above U+10FFFF.
+  } else {
+    return false;
+  }
+
+  if (static_cast<size_t>(end - p) < length)
+    return false;
+  if (p[1] < min || p[1] > max)
+    return false;
+  code_point = (code_point << 6) | (p[1] & 0x3F);
+  for (size_t i = 2; i < length; ++i) {
+    if ((p[i] & 0xC0) != 0x80)
+      return false;
+    code_point = (code_point << 6) | (p[i] & 0x3F);
+  }
+  return true;
+}
+
+inline wchar_t* AppendWide(wchar_t* out, char32_t code_point) {
+  if constexpr (sizeof(wchar_t) == 2) {
+    if (code_point >= 0x10000) {
+      code_point -= 0x10000;
+      *out++ = static_cast<wchar_t>(0xD800 + (code_point >> 10));
+      *out++ = static_cast<wchar_t>(0xDC00 + (code_point & 0x3FF));
+      return out;
+    }
+  }
+  *out++ = static_cast<wchar_t>(code_point);
+  return out;
+}
+
+inline char* AppendUtf8(char* out, char32_t code_point) {
+  if (code_point < 0x80) {
+    *out++ = static_cast<char>(code_point);
+  } else if (code_point < 0x800) {
+    *out++ = static_cast<char>(0xC0 | (code_point >> 6));
+    *out++ = static_cast<char>(0x80 | (code_point & 0x3F));
+  } else if (code_point < 0x10000) {
+    *out++ = static_cast<char>(0xE0 | (code_point >> 12));
+    *out++ = static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+    *out++ = static_cast<char>(0x80 | (code_point & 0x3F));
+  } else {
+    *out++ = static_cast<char>(0xF0 | (code_point >> 18));
+    *out++ = static_cast<char>(0x80 | ((code_point >> 12) & 0x3F));
+    *out++ = static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+    *out++ = static_cast<char>(0x80 | (code_point & 0x3F));
+  }
+  return out;
+}
+
+#if defined(UTF8_USE_AVX2)
+
+inline bool DetectAvx2() {
+#if defined(_MSC_VER) && !defined(__clang__)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7)
+    return false;
+  __cpuid(info, 1);
+  // AVX and OSXSAVE, then the OS must save the YMM registers.
+  if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0)
+    return false;
+  if ((_xgetbv(0) & 6) != 6)
+    return false;
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+// Whether the AVX2 kernels run. Detected once; tests switch it off to cover
+// the SSE2/scalar path on AVX2 machines.
+inline bool& Avx2Enabled() {
+  static bool enabled = DetectAvx2();
+  return enabled;
+}
+
+inline unsigned LowestSetBit(uint32_t mask) {
+#if defined(_MSC_VER) && !defined(__clang__)
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return static_cast<unsigned>(index);
+#else
+  return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+}
+
+// For each 8-bit mask of 16-bit lanes: the pshufb mask which moves the lanes
+// whose bit is set to the front, in order, and how many there are. Moves the
+// code points decoded at lead bytes together.
+struct CompactTable {
+  unsigned char shuffle[256][16];
+  unsigned char count[256];
+};
+
+constexpr CompactTable MakeCompactTable() {
+  CompactTable table{};
+  for (unsigned mask = 0; mask < 256; ++mask) {
+    unsigned char count = 0;
+    for (unsigned char lane = 0; lane < 8; ++lane) {
+      if (mask & (1u << lane)) {
+        table.shuffle[mask][2 * count] = static_cast<unsigned char>(2 * lane);
+        table.shuffle[mask][2 * count + 1] =
+            static_cast<unsigned char>(2 * lane + 1);
+        ++count;
+      }
+    }
+    for (unsigned i = 2 * count; i < 16; ++i)
+      table.shuffle[mask][i] = 0x80;
+    table.count[mask] = count;
+  }
+  return table;
+}
+
+inline constexpr CompactTable kCompactTable = MakeCompactTable();
+
+// For 4 code points encoded into 32-bit lanes, keyed by the UTF-8 length - 1
+// of each lane (its bit 0 in key bits 0-3, its bit 1 in key bits 4-7): the
+// pshufb mask which drops the unused bytes of each lane, and the number of
+// bytes left.
+struct EncodeTable {
+  unsigned char shuffle[256][16];
+  unsigned char length[256];
+};
+
+constexpr EncodeTable MakeEncodeTable() {
+  EncodeTable table{};
+  for (unsigned key = 0; key < 256; ++key) {
+    unsigned char length = 0;
+    for (unsigned lane = 0; lane < 4; ++lane) {
+      const unsigned bytes =
+          1 + ((key >> lane) & 1) + 2 * ((key >> (lane + 4)) & 1);
+      for (unsigned b = 0; b < bytes; ++b)
+        table.shuffle[key][length++] = static_cast<unsigned char>(lane * 4 + b);
+    }
+    for (unsigned i = length; i < 16; ++i)
+      table.shuffle[key][i] = 0x80;
+    table.length[key] = length;
+  }
+  return table;
+}
+
+inline constexpr EncodeTable kEncodeTable = MakeEncodeTable();
+
+// For 8 code points below U+0800 encoded into 16-bit lanes, keyed by
+// (is 2 bytes) per lane: the pshufb mask which drops the unused high bytes,
+// and the number of bytes left.
+constexpr EncodeTable MakeTwoByteTable() {
+  EncodeTable table{};
+  for (unsigned key = 0; key < 256; ++key) {
+    unsigned char length = 0;
+    for (unsigned lane = 0; lane < 8; ++lane) {
+      table.shuffle[key][length++] = static_cast<unsigned char>(2 * lane);
+      if (key & (1u << lane))
+        table.shuffle[key][length++] = static_cast<unsigned char>(2 * lane + 1);
+    }
+    for (unsigned i = length; i < 16; ++i)
+      table.shuffle[key][i] = 0x80;
+    table.length[key] = length;
+  }
+  return table;
+}
+
+inline constexpr EncodeTable kTwoByteTable = MakeTwoByteTable();
+
+UTF8_TARGET_AVX2 inline size_t AsciiPrefixAvx2(const unsigned char* in,
+                                               size_t size) {
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    const __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+    if (_mm256_movemask_epi8(v))
+      break;
+  }
+  return i;
+}
+
+UTF8_TARGET_AVX2 inline size_t WidenAsciiAvx2(const unsigned char* in,
+                                              size_t size,
+                                              wchar_t* out) {
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    const __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+    if (_mm256_movemask_epi8(v))
+      break;
+    if constexpr (sizeof(wchar_t) == 4) {
+      for (size_t k = 0; k < 32; k += 8) {
+        const __m128i bytes =
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + i + k));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i + k),
+                            _mm256_cvtepu8_epi32(bytes));
+      }
+    } else {
+      for (size_t k = 0; k < 32; k += 16) {
+        const __m128i bytes =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + k));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i + k),
+                            _mm256_cvtepu8_epi16(bytes));
+      }
+    }
+  }
+  return i;
+}
+
+UTF8_TARGET_AVX2 inline size_t NarrowAsciiAvx2(const wchar_t* in,
+                                               size_t size,
+                                               char* out) {
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    const __m256i* src = reinterpret_cast<const __m256i*>(in + i);
+    __m256i bytes;
+    if constexpr (sizeof(wchar_t) == 4) {
+      const __m256i a = _mm256_loadu_si256(src + 0);
+      const __m256i b = _mm256_loadu_si256(src + 1);
+      const __m256i c = _mm256_loadu_si256(src + 2);
+      const __m256i d = _mm256_loadu_si256(src + 3);
+      const __m256i any = _mm256_or_si256(_mm256_or_si256(a, b),
+                                          _mm256_or_si256(c, d));
+      if (!_mm256_testz_si256(any, _mm256_set1_epi32(~0x7F)))
+        break;
+      // Packing works per 128-bit lane, the permute restores the order.
+      bytes = _mm256_packus_epi16(_mm256_packs_epi32(a, b),
+                                  _mm256_packs_epi32(c, d));
+      bytes = _mm256_permutevar8x32_epi32(
+          bytes, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+    } else {
+      const __m256i a = _mm256_loadu_si256(src + 0);
+      const __m256i b = _mm256_loadu_si256(src + 1);
+      if (!_mm256_testz_si256(_mm256_or_si256(a, b),
+                              _mm256_set1_epi16(static_cast<short>(0xFF80))))
+        break;
+      bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b),
+                                       _MM_SHUFFLE(3, 1, 2, 0));
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), bytes);
+  }
+  return i;
+}
+
+// Loads a 16-entry pshufb table into both 128-bit lanes.
+UTF8_TARGET_AVX2 inline __m256i LoadTableAvx2(const unsigned char* entries) {
+  return _mm256_broadcastsi128_si256(
+      _mm_load_si128(reinterpret_cast<const __m128i*>(entries)));
+}
+
+// One 32-byte step of the lookup validator. |prev_input| is the previous
+// block, |prev_incomplete| flags a sequence it left unfinished; errors are
+// OR-ed into |error|.
+UTF8_TARGET_AVX2 inline void CheckBlockAvx2(const __m256i& input,
+                                            __m256i& prev_input,
+                                            __m256i& prev_incomplete,
+                                            __m256i& error) {
+  if (!_mm256_movemask_epi8(input)) {
+    // An ASCII block cannot finish a sequence from the previous block.
+    error = _mm256_or_si256(error, prev_incomplete);
+    prev_incomplete = _mm256_setzero_si256();
+    prev_input = input;
+    return;
+  }
+
+  // Error bits; a byte pair is invalid when all three lookups share a bit.
+  enum : unsigned char {
+    kTooShort = 1 << 0,   // Lead byte not followed by a continuation.
+    kTooLong = 1 << 1,    // Continuation after ASCII.
+    kOverlong3 = 1 << 2,  // E0 80..9F.
+    kTooLarge = 1 << 3,   // F4 90.. and above.
+    kSurrogate = 1 << 4,  // ED A0..BF.
+    kOverlong2 = 1 << 5,  // C0, C1.
+    kTooLarge1000 = 1 << 6,
+    kOverlong4 = 1 << 6,  // F0 80..8F.
+    kTwoConts = 1 << 7,   // Continuation after continuation, unless 3rd/4th.
+    kCarry = kTooShort | kTooLong | kTwoConts,
+  };
+  alignas(16) static constexpr unsigned char kByte1High[16] = {
+      kTooLong, kTooLong, kTooLong, kTooLong,
+      kTooLong, kTooLong, kTooLong, kTooLong,
+      kTwoConts, kTwoConts, kTwoConts, kTwoConts,
+      kTooShort | kOverlong2,
+      kTooShort,
+      kTooShort | kOverlong3 | kSurrogate,
+      kTooShort | kTooLarge | kTooLarge1000 | kOverlong4};
+  alignas(16) static constexpr unsigned char kByte1Low[16] = {
+      kCarry | kOverlong3 | kOverlong2 | kOverlong4,
+      kCarry | kOverlong2,
+      kCarry,
+      kCarry,
+      kCarry | kTooLarge,
+      kCarry | kTooLarge | kTooLarge1000,
+      kCarry | kTooLarge | kTooLarge1000,
+      kCarry | kTooLarge | kTooLarge1000,
+      kCarry | kTooLarge | kTooLarge1000,
+      kCarry | kTooLarge | kTooLarge1000,
+      kCarry | kTooLarge | kTooLarge1000,
+      kCarry | kTooLarge | kTooLarge1000,
+      kCarry | kTooLarge | kTooLarge1000,
+      kCarry | kTooLarge | kTooLarge1000 | kSurrogate,
+      kCarry | kTooLarge | kTooLarge1000,
+      kCarry | kTooLarge | kTooLarge1000};
+  alignas(16) static constexpr unsigned char kByte2High[16] = {
+      kTooShort, kTooShort, kTooShort, kTooShort,
+      kTooShort, kTooShort, kTooShort, kTooShort,
+      kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge1000 |
+          kOverlong4,
+      kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge,
+      kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,
+      kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,
+      kTooShort, kTooShort, kTooShort, kTooShort};
+  // Last bytes which start a sequence the block cannot finish.
+  alignas(32) static constexpr unsigned char kIncompleteMax[32] = {
+      255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+      255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+      255, 255, 255, 255, 255, 255, 255, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1};
+
+  const __m256i low_nibble = _mm256_set1_epi8(0x0F);
+  // Bytes shifted in from the previous block: prev1[i] = input[i - 1].
+  const __m256i carried = _mm256_permute2x128_si256(prev_input, input, 0x21);
+  const __m256i prev1 = _mm256_alignr_epi8(input, carried, 15);
+  const __m256i prev2 = _mm256_alignr_epi8(input, carried, 14);
+  const __m256i prev3 = _mm256_alignr_epi8(input, carried, 13);
+
+  const __m256i byte_1_high = _mm256_shuffle_epi8(
+      LoadTableAvx2(kByte1High),
+      _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low_nibble));
+  const __m256i byte_1_low = _mm256_shuffle_epi8(
+      LoadTableAvx2(kByte1Low), _mm256_and_si256(prev1, low_nibble));
+  const __m256i byte_2_high = _mm256_shuffle_epi8(
+      LoadTableAvx2(kByte2High),
+      _mm256_and_si256(_mm256_srli_epi16(input, 4), low_nibble));
+  const __m256i special = _mm256_and_si256(
+      _mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+  // Third and fourth bytes of 3/4-byte sequences must be continuations,
+  // the lookups flag them as kTwoConts, so the two must cancel out.
+  const __m256i is_third = _mm256_subs_epu8(
+      prev2, _mm256_set1_epi8(static_cast<char>(0xE0 - 0x80)));
+  const __m256i is_fourth = _mm256_subs_epu8(
+      prev3, _mm256_set1_epi8(static_cast<char>(0xF0 - 0x80)));
+  const __m256i must_continue =
+      _mm256_and_si256(_mm256_or_si256(is_third, is_fourth),
+                       _mm256_set1_epi8(static_cast<char>(0x80)));
+  error = _mm256_or_si256(error, _mm256_xor_si256(must_continue, special));
+
+  prev_incomplete = _mm256_subs_epu8(
+      input,
+      _mm256_load_si256(reinterpret_cast<const __m256i*>(kIncompleteMax)));
+  prev_input = input;
+}
+
+UTF8_TARGET_AVX2 inline bool IsValidUtf8Avx2(const unsigned char* in,
+                                             size_t size) {
+  __m256i prev_input = _mm256_setzero_si256();
+  __m256i prev_incomplete = _mm256_setzero_si256();
+  __m256i error = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    CheckBlockAvx2(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i)),
+        prev_input, prev_incomplete, error);
+  }
+  // The tail is padded with zeros (ASCII), which also flags a sequence cut
+  // off by the end of the input.
+  alignas(32) unsigned char tail[32] = {};
+  std::memcpy(tail, in + i, size - i);
+  CheckBlockAvx2(_mm256_load_si256(reinterpret_cast<const __m256i*>(tail)),
+                 prev_input, prev_incomplete, error);
+  return _mm256_testz_si256(error, error) != 0;
+}
+
+// Zero-extends 16 bytes to 16-bit lanes.
+UTF8_TARGET_AVX2 inline __m256i LoadBytesAvx2(const unsigned char* p) {
+  return _mm256_cvtepu8_epi16(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+}
+
+// Writes the 16-bit lanes of |code_points| selected by |mask| to |out|.
+UTF8_TARGET_AVX2 inline void StoreCompactedAvx2(__m128i code_points,
+                                                unsigned mask,
+                                                wchar_t*& out) {
+  const __m128i packed = _mm_shuffle_epi8(
+      code_points, _mm_loadu_si128(reinterpret_cast<const __m128i*>(
+                       kCompactTable.shuffle[mask])));
+  if constexpr (sizeof(wchar_t) == 4) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out),
+                        _mm256_cvtepu16_epi32(packed));
+  } else {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), packed);
+  }
+  out += kCompactTable.count[mask];
+}
+
+// Decodes VALID UTF-8 into |out| in windows of up to 31 bytes which end on a
+// sequence boundary: for 16 positions at a time the code point is computed
+// as if each byte were a lead byte, then the lanes at real lead bytes are
+// moved together. Returns the bytes consumed; stops before a 4-byte
+// sequence, at an all-ASCII block (the ASCII path is faster) and when fewer
+// than 34 bytes are left.
+UTF8_TARGET_AVX2 inline size_t DecodeAvx2(const unsigned char* in,
+                                          size_t size,
+                                          wchar_t*& out) {
+  const __m256i continuation_bits = _mm256_set1_epi8(static_cast<char>(0xC0));
+  const __m256i continuation = _mm256_set1_epi8(static_cast<char>(0x80));
+  const __m256i four_byte_lead = _mm256_set1_epi8(static_cast<char>(0xF0));
+  const __m256i low6 = _mm256_set1_epi16(0x3F);
+  wchar_t* dst = out;
+  size_t i = 0;
+  // The second half of a window reads 2 bytes past it.
+  while (i + 34 <= size) {
+    const __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+    if (!_mm256_movemask_epi8(v))
+      break;
+    const uint32_t four = static_cast<uint32_t>(_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_max_epu8(v, four_byte_lead), v)));
+    const uint32_t continuations =
+        static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+            _mm256_and_si256(v, continuation_bits), continuation)));
+
+    // Byte 31 tells whether the window may end before it.
+    unsigned window = 31;
+    if (four && LowestSetBit(four) < window)
+      window = LowestSetBit(four);
+    while (window > 0 && (continuations >> window & 1))
+      --window;
+    if (window == 0)
+      break;
+    const uint32_t leads = ~continuations & ((uint32_t{1} << window) - 1);
+
+    for (unsigned g = 0; g < window; g += 16) {
+      const unsigned char* p = in + i + g;
+      const __m256i b0 = LoadBytesAvx2(p);
+      const __m256i b1 = _mm256_and_si256(LoadBytesAvx2(p + 1), low6);
+      const __m256i b2 = _mm256_and_si256(LoadBytesAvx2(p + 2), low6);
+      const __m256i two_bytes = _mm256_or_si256(
+          _mm256_slli_epi16(_mm256_and_si256(b0, _mm256_set1_epi16(0x1F)), 6),
+          b1);
+      const __m256i three_bytes = _mm256_or_si256(
+          _mm256_or_si256(
+              _mm256_slli_epi16(
+                  _mm256_and_si256(b0, _mm256_set1_epi16(0x0F)), 12),
+              _mm256_slli_epi16(b1, 6)),
+          b2);
+      __m256i code_points = _mm256_blendv_epi8(
+          b0, two_bytes, _mm256_cmpgt_epi16(b0, _mm256_set1_epi16(0xBF)));
+      code_points = _mm256_blendv_epi8(
+          code_points, three_bytes,
+          _mm256_cmpgt_epi16(b0, _mm256_set1_epi16(0xDF)));
+
+      const unsigned mask = (leads >> g) & 0xFFFF;
+      StoreCompactedAvx2(_mm256_castsi256_si128(code_points), mask & 0xFF,
+                         dst);
+      StoreCompactedAvx2(_mm256_extracti128_si256(code_points, 1), mask >> 8,
+                         dst);
+    }
+    i += window;
+  }
+  out = dst;
+  return i;
+}
+
+// Whether the 8 code units at |in| are ASCII.
+UTF8_TARGET_AVX2 inline bool AsciiUnitsAvx2(const wchar_t* in) {
+  if constexpr (sizeof(wchar_t) == 4) {
+    const __m256i units =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+    return _mm256_testz_si256(units, _mm256_set1_epi32(~0x7F)) != 0;
+  } else {
+    const __m128i units = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+    return _mm_testz_si128(units, _mm_set1_epi16(static_cast<short>(0xFF80))) !=
+           0;
+  }
+}
+
+// Encodes the 16 code units at |in| if all are below U+0800, the common case
+// for Latin, Greek, Cyrillic, Hebrew and Arabic text: every code point fits
+// a 16-bit lane as 1 or 2 bytes.
+UTF8_TARGET_AVX2 inline bool EncodeTwoByteAvx2(const wchar_t* in, char*& out) {
+  __m256i units;
+  if constexpr (sizeof(wchar_t) == 4) {
+    const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+    const __m256i b =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 8));
+    if (!_mm256_testz_si256(_mm256_or_si256(a, b),
+                            _mm256_set1_epi32(~0x7FF)))
+      return false;
+    units = _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b),
+                                     _MM_SHUFFLE(3, 1, 2, 0));
+  } else {
+    units = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+    if (!_mm256_testz_si256(units,
+                            _mm256_set1_epi16(static_cast<short>(0xF800))))
+      return false;
+  }
+  const __m256i is_two = _mm256_cmpgt_epi16(units, _mm256_set1_epi16(0x7F));
+  const __m256i lead = _mm256_blendv_epi8(
+      units,
+      _mm256_or_si256(_mm256_srli_epi16(units, 6), _mm256_set1_epi16(0xC0)),
+      is_two);
+  const __m256i trail = _mm256_and_si256(
+      _mm256_slli_epi16(
+          _mm256_or_si256(_mm256_and_si256(units, _mm256_set1_epi16(0x3F)),
+                          _mm256_set1_epi16(0x80)),
+          8),
+      is_two);
+  const __m256i bytes = _mm256_or_si256(lead, trail);
+  // One bit per lane: bits 0-7 for the low half, 16-23 for the high half.
+  const unsigned two = static_cast<unsigned>(
+      _mm256_movemask_epi8(_mm256_packs_epi16(is_two, is_two)));
+  const unsigned key_low = two & 0xFF;
+  const unsigned key_high = (two >> 16) & 0xFF;
+  _mm_storeu_si128(
+      reinterpret_cast<__m128i*>(out),
+      _mm_shuffle_epi8(_mm256_castsi256_si128(bytes),
+                       _mm_loadu_si128(reinterpret_cast<const __m128i*>(
+                           kTwoByteTable.shuffle[key_low]))));
+  out += kTwoByteTable.length[key_low];
+  _mm_storeu_si128(
+      reinterpret_cast<__m128i*>(out),
+      _mm_shuffle_epi8(_mm256_extracti128_si256(bytes, 1),
+                       _mm_loadu_si128(reinterpret_cast<const __m128i*>(
+                           kTwoByteTable.shuffle[key_high]))));
+  out += kTwoByteTable.length[key_high];
+  return true;
+}
+
+// Encodes code points 16 at a time while they are below U+0800, otherwise 8
+// at a time: each code point's UTF-8 bytes are built in its 32-bit lane, then
+// one pshufb per 4 lanes drops the unused bytes.
+// Returns the code units consumed; stops at 16 ASCII units (the ASCII path is
+// faster), at a surrogate or a value above U+10FFFF (left to ReadWide(),
+// which also pairs UTF-16 surrogates) and when fewer than 16 units are left,
+// so the 16-byte stores stay within the 3 (UTF-16) or 4 (UTF-32) bytes per
+// unit reserved by WideToUtf8().
+UTF8_TARGET_AVX2 inline size_t EncodeAvx2(const wchar_t* in,
+                                          size_t size,
+                                          char*& out) {
+  const __m256i low6 = _mm256_set1_epi32(0x3F);
+  char* dst = out;
+  size_t i = 0;
+  while (i + 16 <= size) {
+    __m256i cp;
+    if constexpr (sizeof(wchar_t) == 4) {
+      cp = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+    } else {
+      cp = _mm256_cvtepu16_epi32(
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)));
+    }
+    const __m256i is_two = _mm256_cmpgt_epi32(cp, _mm256_set1_epi32(0x7F));
+    const int two = _mm256_movemask_ps(_mm256_castsi256_ps(is_two));
+    if (two == 0 && AsciiUnitsAvx2(in + i + 8))
+      break;
+    if (EncodeTwoByteAvx2(in + i, dst)) {
+      i += 16;
+      continue;
+    }
+    const __m256i in_range = _mm256_cmpeq_epi32(
+        _mm256_min_epu32(cp, _mm256_set1_epi32(0x10FFFF)), cp);
+    const __m256i surrogate =
+        _mm256_cmpeq_epi32(_mm256_and_si256(cp, _mm256_set1_epi32(0xF800)),
+                           _mm256_set1_epi32(0xD800));
+    const int bad = ~_mm256_movemask_ps(_mm256_castsi256_ps(
+                        _mm256_andnot_si256(surrogate, in_range))) &
+                    0xFF;
+    // A bad unit in the upper half still lets the lower 4 units through.
+    if (bad & 0x0F)
+      break;
+    const size_t units = bad ? 4 : 8;
+
+    // Bytes in memory order, lowest byte first: the lead byte, then the
+    // continuation bytes.
+    const __m256i is_three = _mm256_cmpgt_epi32(cp, _mm256_set1_epi32(0x7FF));
+    const __m256i two_bytes = _mm256_or_si256(
+        _mm256_or_si256(_mm256_srli_epi32(cp, 6), _mm256_set1_epi32(0x80C0)),
+        _mm256_and_si256(_mm256_slli_epi32(cp, 8), _mm256_set1_epi32(0x3F00)));
+    const __m256i three_bytes = _mm256_or_si256(
+        _mm256_or_si256(_mm256_srli_epi32(cp, 12),
+                        _mm256_set1_epi32(0x8080E0)),
+        _mm256_or_si256(
+            _mm256_and_si256(_mm256_slli_epi32(cp, 2),
+                             _mm256_set1_epi32(0x3F00)),
+            _mm256_slli_epi32(_mm256_and_si256(cp, low6), 16)));
+    __m256i bytes = _mm256_blendv_epi8(cp, two_bytes, is_two);
+    bytes = _mm256_blendv_epi8(bytes, three_bytes, is_three);
+    int four = 0;
+    if constexpr (sizeof(wchar_t) == 4) {
+      const __m256i is_four =
+          _mm256_cmpgt_epi32(cp, _mm256_set1_epi32(0xFFFF));
+      four = _mm256_movemask_ps(_mm256_castsi256_ps(is_four));
+      if (four) {
+        const __m256i four_bytes = _mm256_or_si256(
+            _mm256_or_si256(
+                _mm256_srli_epi32(cp, 18),
+                _mm256_set1_epi32(static_cast<int>(0x808080F0u))),
+            _mm256_or_si256(
+                _mm256_or_si256(
+                    _mm256_and_si256(_mm256_srli_epi32(cp, 4),
+                                     _mm256_set1_epi32(0x3F00)),
+                    _mm256_and_si256(_mm256_slli_epi32(cp, 10),
+                                     _mm256_set1_epi32(0x3F0000))),
+                _mm256_slli_epi32(_mm256_and_si256(cp, low6), 24)));
+        bytes = _mm256_blendv_epi8(bytes, four_bytes, is_four);
+      }
+    }
+
+    // Length - 1 per lane: bit 0 is set for 2 and 4 bytes, bit 1 for 3 and 4.
+    const int three = _mm256_movemask_ps(_mm256_castsi256_ps(is_three));
+    const unsigned length_bit0 = static_cast<unsigned>(two ^ three ^ four);
+    const unsigned length_bit1 = static_cast<unsigned>(three);
+    const unsigned key_low = (length_bit0 & 0x0F) | ((length_bit1 & 0x0F) << 4);
+    _mm_storeu_si128(
+        reinterpret_cast<__m128i*>(dst),
+        _mm_shuffle_epi8(_mm256_castsi256_si128(bytes),
+                         _mm_loadu_si128(reinterpret_cast<const __m128i*>(
+                             kEncodeTable.shuffle[key_low]))));
+    dst += kEncodeTable.length[key_low];
+    if (units == 8) {
+      const unsigned key_high = (length_bit0 >> 4) | (length_bit1 & 0xF0);
+      _mm_storeu_si128(
+          reinterpret_cast<__m128i*>(dst),
+          _mm_shuffle_epi8(_mm256_extracti128_si256(bytes, 1),
+                           _mm_loadu_si128(reinterpret_cast<const __m128i*>(
+                               kEncodeTable.shuffle[key_high]))));
+      dst += kEncodeTable.length[key_high];
+    }
+    i += units;
+  }
+  out = dst;
+  return i;
+}
+
+#endif  // UTF8_USE_AVX2
+
+// Length of the ASCII prefix of |in|.
+inline size_t AsciiPrefix(const unsigned char* in, size_t size) {
+  size_t i = 0;
+#if defined(UTF8_USE_AVX2)
+  if (Avx2Enabled())
+    i = AsciiPrefixAvx2(in, size);
+#endif
+#if defined(UTF8_USE_SSE2)
+  for (; i + 16 <= size; i += 16) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    if (_mm_movemask_epi8(v))
+      break;
+  }
+#endif
+  while (i < size && in[i] < 0x80)
+    ++i;
+  return i;
+}
+
+// Widens the ASCII prefix of |in| into |out|, returns its length.
+inline size_t WidenAscii(const unsigned char* in, size_t size, wchar_t* out) {
+  size_t i = 0;
+#if defined(UTF8_USE_AVX2)
+  if (Avx2Enabled())
+    i = WidenAsciiAvx2(in, size, out);
+#endif
+#if defined(UTF8_USE_SSE2)
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 16 <= size; i += 16) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    if (_mm_movemask_epi8(v))
+      break;
+    const __m128i lo = _mm_unpacklo_epi8(v, zero);
+    const __m128i hi = _mm_unpackhi_epi8(v, zero);
+    __m128i* dst = reinterpret_cast<__m128i*>(out + i);
+    if constexpr (sizeof(wchar_t) == 4) {
+      _mm_storeu_si128(dst + 0, _mm_unpacklo_epi16(lo, zero));
+      _mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(lo, zero));
+      _mm_storeu_si128(dst + 2, _mm_unpacklo_epi16(hi, zero));
+      _mm_storeu_si128(dst + 3, _mm_unpackhi_epi16(hi, zero));
+    } else {
+      _mm_storeu_si128(dst + 0, lo);
+      _mm_storeu_si128(dst + 1, hi);
+    }
+  }
+#endif
+  for (; i < size && in[i] < 0x80; ++i)
+    out[i] = static_cast<wchar_t>(in[i]);
+  return i;
+}
+
+inline bool IsAsciiUnit(wchar_t c) {
+  return (static_cast<uint32_t>(c) & ~uint32_t{0x7F}) == 0;
+}
+
+// Narrows the ASCII prefix of |in| into |out|, returns its length.
+inline size_t NarrowAscii(const wchar_t* in, size_t size, char* out) {
+  size_t i = 0;
+#if defined(UTF8_USE_AVX2)
+  if (Avx2Enabled())
+    i = NarrowAsciiAvx2(in, size, out);
+#endif
+#if defined(UTF8_USE_SSE2)
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 16 <= size; i += 16) {
+    const __m128i* src = reinterpret_cast<const __m128i*>(in + i);
+    __m128i bytes;
+    if constexpr (sizeof(wchar_t) == 4) {
+      const __m128i a = _mm_loadu_si128(src + 0);
+      const __m128i b = _mm_loadu_si128(src + 1);
+      const __m128i c = _mm_loadu_si128(src + 2);
+      const __m128i d = _mm_loadu_si128(src + 3);
+      const __m128i high_bits = _mm_and_si128(
+          _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d)),
+          _mm_set1_epi32(~0x7F));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi32(high_bits, zero)) != 0xFFFF)
+        break;
+      bytes = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+    } else {
+      const __m128i a = _mm_loadu_si128(src + 0);
+      const __m128i b = _mm_loadu_si128(src + 1);
+      const __m128i high_bits =
+          _mm_and_si128(_mm_or_si128(a, b),
+                        _mm_set1_epi16(static_cast<short>(0xFF80)));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi16(high_bits, zero)) != 0xFFFF)
+        break;
+      bytes = _mm_packus_epi16(a, b);
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), bytes);
+  }
+#endif
+  for (; i < size && IsAsciiUnit(in[i]); ++i)
+    out[i] = static_cast<char>(in[i]);
+  return i;
+}
+
+// Reads one code point from UTF-16 or UTF-32 |in|, rejecting lone surrogates
+// and values above U+10FFFF.
+inline bool ReadWide(const wchar_t* in,
+                     const wchar_t* end,
+                     char32_t& code_point,
+                     size_t& length) {
+  const uint32_t c = static_cast<uint32_t>(in[0]) &
+                     (sizeof(wchar_t) == 2 ? 0xFFFFu : 0xFFFFFFFFu);
+  length = 1;
+  if (c >= 0xD800 && c <= 0xDBFF && sizeof(wchar_t) == 2) {
+    if (end - in < 2)
+      return false;
+    const uint32_t low = static_cast<uint32_t>(in[1]) & 0xFFFF;
+    if (low < 0xDC00 || low > 0xDFFF)
+      return false;
+    code_point = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+    length = 2;
+    return true;
+  }
+  if ((c >= 0xD800 && c <= 0xDFFF) || c > 0x10FFFF)
+    return false;
+  code_point = c;
+  return true;
+}
+
+}  // namespace utf8_internal
+
+// 1. Validation.
+
+inline bool IsValidUtf8(const char* data, size_t size) {
+  const unsigned char* in = reinterpret_cast<const unsigned char*>(data);
+#if defined(UTF8_USE_AVX2)
+  if (utf8_internal::Avx2Enabled())
+    return utf8_internal::IsValidUtf8Avx2(in, size);
+#endif
+  const unsigned char* end = in + size;
+  while (in < end) {
+    in += utf8_internal::AsciiPrefix(in, static_cast<size_t>(end - in));
+    while (in < end && *in >= 0x80) {
+      char32_t code_point;
+      size_t length;
+      if (!utf8_internal::DecodeOne(in, end, code_point, length))
+        return false;
+      in += length;
+    }
+  }
+  return true;
+}
+
+// 2. UTF-8 -> wchar_t. Appends to |out|; on invalid input |out| is left
+// unchanged and false is returned.
+
+inline bool Utf8ToWide(const char* data, size_t size, std::wstring& out) {
+#if defined(UTF8_USE_AVX2)
+  // The vector decoder assumes valid input, check it up front.
+  const bool avx2 = utf8_internal::Avx2Enabled();
+  if (avx2 && !utf8_internal::IsValidUtf8Avx2(
+                  reinterpret_cast<const unsigned char*>(data), size))
+    return false;
+#endif
+  const size_t base = out.size();
+  // One UTF-8 byte never produces more than one UTF-16/UTF-32 code unit.
+  out.resize(base + size);
+  wchar_t* dst = &out[0] + base;
+  const unsigned char* in = reinterpret_cast<const unsigned char*>(data);
+  const unsigned char* end = in + size;
+  while (in < end) {
+    const size_t ascii =
+        utf8_internal::WidenAscii(in, static_cast<size_t>(end - in), dst);
+    in += ascii;
+    dst += ascii;
+    while (in < end && *in >= 0x80) {
+#if defined(UTF8_USE_AVX2)
+      if (avx2) {
+        const size_t decoded = utf8_internal::DecodeAvx2(
+            in, static_cast<size_t>(end - in), dst);
+        if (decoded) {
+          in += decoded;
+          continue;
+        }
+      }
+#endif
+      char32_t code_point;
+      size_t length;
+      if (!utf8_internal::DecodeOne(in, end, code_point, length)) {
+        out.resize(base);
+        return false;
+      }
+      dst = utf8_internal::AppendWide(dst, code_point);
+      in += length;
+    }
+  }
+  out.resize(static_cast<size_t>(dst - out.data()));
+  return true;
+}
+
+inline bool Utf8ToWide(const std::string& text, std::wstring& out) {
+  return Utf8ToWide(text.data(), text.size(), out);
+}
+
+// 3. wchar_t -> UTF-8. Appends to |out|; on invalid input (lone surrogate,
+// value above U+10FFFF) |out| is left unchanged and false is returned.
+// WideToUtf8Lossy() writes U+FFFD for each invalid code unit instead, for
+// text which must not be dropped.
+
+namespace utf8_internal {
+
+inline bool WideToUtf8(const wchar_t* data,
+                       size_t size,
+                       std::string& out,
+                       bool replace_invalid) {
+  const size_t base = out.size();
+  // A UTF-16 unit encodes to at most 3 bytes (surrogate pairs: 4 bytes for 2
+  // units), a UTF-32 unit to at most 4.
+  out.resize(base + size * (sizeof(wchar_t) == 2 ? 3 : 4));
+#if defined(UTF8_USE_AVX2)
+  const bool avx2 = utf8_internal::Avx2Enabled();
+#endif
+  char* dst = &out[0] + base;
+  const wchar_t* in = data;
+  const wchar_t* end = data + size;
+  while (in < end) {
+    const size_t ascii =
+        utf8_internal::NarrowAscii(in, static_cast<size_t>(end - in), dst);
+    in += ascii;
+    dst += ascii;
+    while (in < end && !utf8_internal::IsAsciiUnit(*in)) {
+#if defined(UTF8_USE_AVX2)
+      if (avx2) {
+        const size_t encoded = utf8_internal::EncodeAvx2(
+            in, static_cast<size_t>(end - in), dst);
+        if (encoded) {
+          in += encoded;
+          continue;
+        }
+      }
+#endif
+      char32_t code_point;
+      size_t length;
+      if (!utf8_internal::ReadWide(in, end, code_point, length)) {
+        if (!replace_invalid) {
+          out.resize(base);
+          return false;
+        }
+        // |length| is 1: a lone high surrogate is replaced on its own and
+        // the unit after it is read again.
+        code_point = 0xFFFD;
+      }
+      dst = utf8_internal::AppendUtf8(dst, code_point);
+      in += length;
+    }
+  }
+  out.resize(static_cast<size_t>(dst - out.data()));
+  return true;
+}
+
+}  // namespace utf8_internal
+
+inline bool WideToUtf8(const wchar_t* data, size_t size, std::string& out) {
+  return utf8_internal::WideToUtf8(data, size, out, false);
+}
+
+inline bool WideToUtf8(const std::wstring& text, std::string& out) {
+  return WideToUtf8(text.data(), text.size(), out);
+}
+
+inline void WideToUtf8Lossy(const wchar_t* data,
+                            size_t size,
+                            std::string& out) {
+  utf8_internal::WideToUtf8(data, size, out, true);
+}
+
+inline void WideToUtf8Lossy(const std::wstring& text, std::string& out) {
+  WideToUtf8Lossy(text.data(), text.size(), out);
+}
+
+// 4. Utf8Buffer: drop-in target for the std::wcout based helpers, e.g.
+// NS_CArrayInArgs::Array_Info(buffer, ...). Wide strings are transcoded
+// straight into a UTF-8 std::string, skipping the locale codecvt; invalid
+// code units become U+FFFD rather than losing the whole string.
+
+// Everything else std::wcout can print (numbers, bool, pointers) and every
+// manipulator (setw, left, fixed, setprecision, endl, ...) goes through an
+// internal std::wostringstream, so the output is what std::wcout would print.
+// Formatting state persists across insertions like on a stream; clear() only
+// drops the text.
+
+class Utf8Buffer {
+ public:
+  Utf8Buffer& operator<<(const wchar_t* text) {
+    if (m_format.width() != 0)
+      return Format(text);
+    WideToUtf8Lossy(text, std::wcslen(text), m_data);
+    return *this;
+  }
+
+  Utf8Buffer& operator<<(const std::wstring& text) {
+    if (m_format.width() != 0)
+      return Format(text);
+    WideToUtf8Lossy(text, m_data);
+    return *this;
+  }
+
+  // Narrow strings are taken as UTF-8 already.
+  Utf8Buffer& operator<<(const char* text) {
+    if (m_format.width() == 0) {
+      m_data += text;
+      return *this;
+    }
+    std::wstring wide;
+    if (!Utf8ToWide(text, std::strlen(text), wide)) {
+      m_data += text;
+      return *this;
+    }
+    return Format(wide);
+  }
+
+  template <typename T,
+            typename = decltype(std::declval<std::wostream&>()
+                                << std::declval<const T&>())>
+  Utf8Buffer& operator<<(const T& value) {
+    return Format(value);
+  }
+
+  Utf8Buffer& operator<<(std::wostream& (*manipulator)(std::wostream&)) {
+    manipulator(m_format);
+    Flush();
+    return *this;
+  }
+
+  Utf8Buffer& operator<<(std::ios_base& (*manipulator)(std::ios_base&)) {
+    manipulator(m_format);
+    return *this;
+  }
+
+  const std::string& str() const { return m_data; }
+  void clear() { m_data.clear(); }
+
+ private:
+  template <typename T>
+  Utf8Buffer& Format(const T& value) {
+    m_format << value;
+    Flush();
+    return *this;
+  }
+
+  void Flush() {
+    WideToUtf8Lossy(m_format.str(), m_data);
+    m_format.str(std::wstring());
+  }
+
+  std::string m_data;
+  std::wostringstream m_format;
+};
+
+// ###############################################################################
+
+TEST(Utf8Transcoding, Utf8Transcoding) {
+  // "Decay: " + Cyrillic + CJK + an emoji outside the BMP, long enough to
+  // cross several vector blocks.
+  const std::string utf8 =
+      "Decay: template metaprogramming \xD0\xBF\xD1\x80\xD0\xB8\xD0\xB2"
+      "\xD0\xB5\xD1\x82 \xE6\xA8\xA1\xE6\x9D\xBF \xF0\x9F\x98\x80 and "
+      "a long ASCII tail to exercise the vectorized fast path.";
+  std::wstring wide;
+  ASSERT_TRUE(IsValidUtf8(utf8.data(), utf8.size()));
+  ASSERT_TRUE(Utf8ToWide(utf8, wide));
+  ASSERT_EQ(wide.substr(0, 7), L"Decay: ");
+  ASSERT_EQ(wide[32], L'\x043F');
+
+  std::string round_trip;
+  ASSERT_TRUE(WideToUtf8(wide, round_trip));
+  ASSERT_EQ(round_trip, utf8);
+
+  // Overlong '/', a UTF-16 surrogate, a truncated sequence, > U+10FFFF.
+  const char* invalid[] = {"\xC0\xAF", "\xED\xA0\x80", "ab\xE6\xA8",
+                           "\xF4\x90\x80\x80"};
+  for (const char* text : invalid) {
+    ASSERT_FALSE(IsValidUtf8(text, std::strlen(text)));
+    std::wstring rejected = L"kept";
+    ASSERT_FALSE(Utf8ToWide(text, std::strlen(text), rejected));
+    ASSERT_EQ(rejected, L"kept");
+  }
+
+  Utf8Buffer buffer;
+  double values[] = {1.0, 2.0, 3.0};
+  NS_CArrayInArgs::Array_Info(buffer, L"values", values);
+  ASSERT_EQ(buffer.str(), "Size of array \"values\" is: 3\n");
+
+  // Numbers and manipulators are formatted as std::wcout would.
+  buffer.clear();
+  buffer << 65.7 << L' ' << 2.5f << L' ' << true << L' ' << L'A' << std::endl;
+  ASSERT_EQ(buffer.str(), "65.7 2.5 1 A\n");
+  buffer.clear();
+  buffer << std::left << std::setw(6) << L"\x043F" << L'|' << std::right
+         << std::setw(4) << 42 << L'|' << std::setw(5) << "ab" << L'|'
+         << std::fixed << std::setprecision(2) << 3.14159;
+  ASSERT_EQ(buffer.str(), "\xD0\xBF     |  42|   ab|3.14");
+  buffer.clear();
+  buffer << std::setprecision(1) << 0.125 << L' ' << 7;
+  ASSERT_EQ(buffer.str(), "0.1 7");
+
+  // An invalid code unit is replaced, the rest of the string is kept, on
+  // the direct path and through the formatting stream.
+  const std::wstring lone_surrogate =
+      std::wstring(L"a") + static_cast<wchar_t>(0xD800) + L"b";
+  buffer.clear();
+  buffer << L"x=" << lone_surrogate << L"|" << lone_surrogate.c_str() << L"|"
+         << std::setw(4) << lone_surrogate << L"|";
+  ASSERT_EQ(buffer.str(),
+            "x=a\xEF\xBF\xBD" "b|a\xEF\xBF\xBD" "b| a\xEF\xBF\xBD" "b|");
+  std::string strict = "kept";
+  ASSERT_FALSE(WideToUtf8(lone_surrogate, strict));
+  ASSERT_EQ(strict, "kept");
+  // Each unit of a broken pair is replaced on its own.
+  std::wstring units = {static_cast<wchar_t>(0xDC00),
+                        static_cast<wchar_t>(0xDBFF), L'c'};
+  std::string lossy;
+  WideToUtf8Lossy(units, lossy);
+  ASSERT_EQ(lossy, "\xEF\xBF\xBD\xEF\xBF\xBD" "c");
+}
+
+TEST(Utf8Transcoding, Utf8BufferAsOutputTarget) {
+  Utf8Buffer buffer;
+  PrintTypesTo(buffer, 1, 2.5);
+  ASSERT_EQ(buffer.str(),
+            "1                 size =  4\n"
+            "2.5               size =  8\n");
+
+  buffer.clear();
+  ClassifyTypeInReturn(buffer, 7);
+  ClassifyTypeInTrailingReturn(buffer, 7);
+  ClassifyTypeInParameter(buffer, 7);
+  ClassifyTypeInFunction(buffer, 7);
+  std::string classified;
+  for (int i = 0; i < 4; ++i)
+    classified += "Type = integral; 3 * value = 21\n";
+  ASSERT_EQ(buffer.str(), classified);
+
+  buffer.clear();
+  NS_MetaFunctionAndTypeTraits::Test(buffer);
+  ASSERT_NE(buffer.str().find("IsPointer<int*>::value: 1\n"),
+            std::string::npos);
+  ASSERT_NE(buffer.str().find("TypeInfo for bool size = 1 is_number: 0 "
+                              "is_pointer: 0 is_const: 0\n"),
+            std::string::npos);
+
+  buffer.clear();
+  PrintTypeInfo<int>(buffer);
+  buffer << TypeName<int>() << L' ' << TypeName<long>();
+  ASSERT_EQ(buffer.str(),
+            "TypeInfo for int size = 4 is_number: 1 is_pointer: 0 "
+            "is_const: 0\nint unknown");
+}
+
+// With AVX2 the vector kernels must agree with the SSE2/scalar path, which
+// they replace on multi-byte text, including where sequences straddle the
+// 32-byte blocks and where invalid bytes fall inside a vector window.
+TEST(Utf8Transcoding, VectorPathMatchesScalar) {
+  std::mt19937 random(2026);
+  const auto pick = [&](uint32_t low, uint32_t high) {
+    return std::uniform_int_distribution<uint32_t>(low, high)(random);
+  };
+  // Runs of ASCII, 2-, 3- and 4-byte code points of random lengths.
+  const auto random_text = [&](size_t code_points) {
+    std::u32string text;
+    while (text.size() < code_points) {
+      const uint32_t kind = pick(0, 9);
+      for (uint32_t n = pick(1, 40); n > 0; --n) {
+        if (kind < 3)
+          text += static_cast<char32_t>(pick(0x20, 0x7F));
+        else if (kind < 6)
+          text += static_cast<char32_t>(pick(0x80, 0x7FF));
+        else if (kind < 9)
+          text += static_cast<char32_t>(pick(0, 1) ? pick(0x800, 0xD7FF)
+                                                   : pick(0xE000, 0xFFFF));
+        else
+          text += static_cast<char32_t>(pick(0x10000, 0x10FFFF));
+      }
+    }
+    return text;
+  };
+  struct Results {
+    bool valid = false;
+    bool decoded = false;
+    bool encoded = false;
+    std::wstring wide = L"kept";
+    std::string utf8 = "kept";
+    std::string lossy;
+  };
+  const auto run = [](const std::string& utf8, const std::wstring& wide) {
+    Results results;
+    results.valid = IsValidUtf8(utf8.data(), utf8.size());
+    results.decoded = Utf8ToWide(utf8, results.wide);
+    results.encoded = WideToUtf8(wide, results.utf8);
+    WideToUtf8Lossy(wide, results.lossy);
+    return results;
+  };
+  const auto run_scalar = [&](const std::string& utf8,
+                              const std::wstring& wide) {
+#if defined(UTF8_USE_AVX2)
+    const bool enabled = utf8_internal::Avx2Enabled();
+    utf8_internal::Avx2Enabled() = false;
+    Results results = run(utf8, wide);
+    utf8_internal::Avx2Enabled() = enabled;
+    return results;
+#else
+    return run(utf8, wide);
+#endif
+  };
+
+  for (int round = 0; round < 300; ++round) {
+    const std::u32string text = random_text(pick(1, 300));
+    std::string utf8(text.size() * 4, '\0');
+    std::wstring wide(text.size() * 2, L'\0');
+    char* utf8_end = &utf8[0];
+    wchar_t* wide_end = &wide[0];
+    for (char32_t code_point : text) {
+      utf8_end = utf8_internal::AppendUtf8(utf8_end, code_point);
+      wide_end = utf8_internal::AppendWide(wide_end, code_point);
+    }
+    utf8.resize(static_cast<size_t>(utf8_end - utf8.data()));
+    wide.resize(static_cast<size_t>(wide_end - wide.data()));
+
+    const Results results = run(utf8, wide);
+    ASSERT_TRUE(results.valid);
+    ASSERT_TRUE(results.decoded);
+    ASSERT_EQ(results.wide, L"kept" + wide);
+    ASSERT_TRUE(results.encoded);
+    ASSERT_EQ(results.utf8, "kept" + utf8);
+
+    // Corrupt a byte and a code unit: an invalid lead or continuation byte,
+    // a cut-off sequence, a lone surrogate or a value above U+10FFFF.
+    const unsigned char bad_bytes[] = {0x80, 0xBF, 0xC0, 0xC1, 0xE0,
+                                       0xED, 0xF0, 0xF4, 0xF5, 0xFF};
+    const bool utf32 = sizeof(wchar_t) == 4;
+    const wchar_t bad_units[] = {
+        static_cast<wchar_t>(0xD800), static_cast<wchar_t>(0xDBFF),
+        static_cast<wchar_t>(0xDC00), static_cast<wchar_t>(0xDFFF),
+        static_cast<wchar_t>(utf32 ? 0x110000 : 0xD800),
+        static_cast<wchar_t>(utf32 ? 0x80000041u : 0xDC00u)};
+    std::string bad_utf8 = utf8;
+    std::wstring bad_wide = wide;
+    bad_utf8[pick(0, static_cast<uint32_t>(utf8.size() - 1))] = static_cast<
+        char>(bad_bytes[pick(0, std::size(bad_bytes) - 1)]);
+    bad_wide[pick(0, static_cast<uint32_t>(wide.size() - 1))] =
+        bad_units[pick(0, std::size(bad_units) - 1)];
+    if (pick(0, 1))
+      bad_utf8.resize(pick(0, static_cast<uint32_t>(bad_utf8.size())));
+
+    const Results vector = run(bad_utf8, bad_wide);
+    const Results scalar = run_scalar(bad_utf8, bad_wide);
+    ASSERT_EQ(vector.valid, scalar.valid);
+    ASSERT_EQ(vector.decoded, scalar.decoded);
+    ASSERT_EQ(vector.wide, scalar.wide);
+    ASSERT_EQ(vector.encoded, scalar.encoded);
+    ASSERT_EQ(vector.utf8, scalar.utf8);
+    ASSERT_EQ(vector.lossy, scalar.lossy);
+  }
+
+  // Each kind of invalid sequence at every offset around a block boundary.
+  const std::string filler = "\xD0\xBF\xE6\xA8\xA1" "a";  // 6 bytes.
+  const char* invalid[] = {"\xC0\xAF",         "\xC1\xBF",
+                           "\xE0\x9F\xBF",     "\xED\xA0\x80",
+                           "\xF0\x8F\xBF\xBF", "\xF4\x90\x80\x80",
+                           "\xF5\x80\x80\x80", "\xE6\xA8",
+                           "\xD0\xBF\xBF",     "\xF0\x9F\x98"};
+  for (const char* sequence : invalid) {
+    for (size_t offset = 0; offset < 70; ++offset) {
+      std::string text;
+      while (text.size() + filler.size() <= offset)
+        text += filler;
+      text.resize(offset, 'a');
+      text += sequence;
+      text += filler + filler + filler + filler + filler + filler;
+      ASSERT_FALSE(IsValidUtf8(text.data(), text.size()));
+      std::wstring wide;
+      ASSERT_FALSE(Utf8ToWide(text, wide));
+      ASSERT_TRUE(wide.empty());
+    }
+  }
+}
+
+// ###############################################################################
+
+// Benchmark: GB/s of UTF-8 input on ASCII-heavy and mixed-script text against
+// the locale's codecvt<wchar_t, char>.
+// Disabled by default, run with --gtest_also_run_disabled_tests.
+
+namespace NS_Utf8Transcoding {
+
+inline std::string RepeatToSize(const std::string& line, size_t size) {
+  std::string text;
+  text.reserve(size + line.size());
+  while (text.size() < size)
+    text += line;
+  return text;
+}
+
+template <typename Func>
+double GigabytesPerSecond(size_t bytes, int repeat, Func&& func) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < repeat; ++i)
+    func();
+  auto stop = std::chrono::steady_clock::now();
+  return static_cast<double>(bytes) * repeat /
+         std::chrono::duration<double, std::nano>(stop - start).count();
+}
+
+inline bool LocaleToWide(const std::locale& locale,
+                         const std::string& in,
+                         std::wstring& out) {
+  using Codecvt = std::codecvt<wchar_t, char, std::mbstate_t>;
+  const Codecvt& codecvt = std::use_facet<Codecvt>(locale);
+  std::mbstate_t state{};
+  out.resize(in.size());
+  const char* from_next = nullptr;
+  wchar_t* to_next = nullptr;
+  const auto result =
+      codecvt.in(state, in.data(), in.data() + in.size(), from_next, &out[0],
+                 &out[0] + out.size(), to_next);
+  out.resize(static_cast<size_t>(to_next - out.data()));
+  return result == Codecvt::ok;
+}
+
+inline bool FindUtf8Locale(std::locale& locale) {
+  for (const char* name : {"C.UTF-8", "en_US.UTF-8", ".utf8"}) {
+    try {
+      locale = std::locale(name);
+      return true;
+    } catch (const std::runtime_error&) {
+    }
+  }
+  return false;
+}
+
+// Words of random letters from several scripts, so the mix of sequence
+// lengths does not repeat the way RepeatToSize() text does.
+inline std::string RandomWords(size_t size) {
+  std::mt19937 random(42);
+  const char32_t alphabets[][2] = {
+      {U'a', 26}, {0x0430, 32}, {0x03B1, 24}, {0x4E00, 2000}};
+  std::string text;
+  char buffer[4];
+  while (text.size() < size) {
+    const auto& alphabet = alphabets[random() % std::size(alphabets)];
+    for (size_t n = 2 + random() % 8; n > 0; --n) {
+      const char32_t letter =
+          alphabet[0] + static_cast<char32_t>(random() % alphabet[1]);
+      text.append(buffer, utf8_internal::AppendUtf8(buffer, letter));
+    }
+    text += random() % 10 == 0 ? '\n' : ' ';
+  }
+  return text;
+}
+
+inline void BenchInput(const wchar_t* name, const std::string& utf8) {
+  const int kRepeat = 8;
+  std::wstring wide;
+  std::string narrow;
+  size_t valid = 0;
+  // Called through a volatile pointer so the loop-invariant call is not
+  // hoisted out of the timing loop.
+  bool (*volatile validate)(const char*, size_t) = &IsValidUtf8;
+  Utf8ToWide(utf8, wide);
+
+  std::wcout << std::left << std::setw(14) << name << std::right
+             << L" UTF-8 -> wchar_t " << std::setw(7)
+             << GigabytesPerSecond(utf8.size(), kRepeat,
+                                   [&] {
+                                     wide.clear();
+                                     Utf8ToWide(utf8, wide);
+                                   })
+             << L" GB/s, wchar_t -> UTF-8 " << std::setw(7)
+             << GigabytesPerSecond(utf8.size(), kRepeat,
+                                   [&] {
+                                     narrow.clear();
+                                     WideToUtf8(wide, narrow);
+                                   })
+             << L" GB/s, validate " << std::setw(7)
+             << GigabytesPerSecond(
+                    utf8.size(), kRepeat,
+                    [&] { valid += validate(utf8.data(), utf8.size()); })
+             << L" GB/s (" << valid << L" valid)";
+
+  std::locale locale;
+  if (FindUtf8Locale(locale)) {
+    std::wstring by_locale;
+    std::wcout << L", locale codecvt " << std::setw(7)
+               << GigabytesPerSecond(
+                      utf8.size(), kRepeat,
+                      [&] { LocaleToWide(locale, utf8, by_locale); })
+               << L" GB/s";
+  }
+  std::wcout << std::endl;
+}
+
+}  // namespace NS_Utf8Transcoding
+
+TEST(Utf8Transcoding, DISABLED_Benchmark) {
+  using namespace NS_Utf8Transcoding;
+
+  const size_t kSize = 1 << 22;
+  std::wcout << std::fixed << std::setprecision(3);
+#if defined(UTF8_USE_AVX2)
+  std::wcout << L"AVX2 kernels: "
+             << (utf8_internal::Avx2Enabled() ? L"on" : L"off") << std::endl;
+#endif
+  BenchInput(L"ASCII-heavy",
+             RepeatToSize("2026-10-19 12:00:00.000 INFO [worker-3] request "
+                          "id=42 path=/api/v1/items status=200 took=3ms\n",
+                          kSize));
+  BenchInput(L"mixed-script",
+             RepeatToSize("user=\xD0\x98\xD0\xB2\xD0\xB0\xD0\xBD city="
+                          "\xE6\x9D\xB1\xE4\xBA\xAC msg=\xCE\xBA\xCE\xB1"
+                          "\xCE\xBB\xCE\xB7\xCE\xBC\xCE\xAD\xCF\x81\xCE\xB1 "
+                          "\xF0\x9F\x91\x8B status=ok\n",
+                          kSize));
+  BenchInput(L"random words", RandomWords(kSize));
+}
@@ -8,17 +8,25 @@
 
 // ###############################################################################
 
-template <typename T>
-void PrintTypes(const T& x) {
-  std::wcout << std::left << std::setw(15) << x << std::setw(10) << std::right
-             << L" size = " << std::setw(2) << sizeof(x) << std::endl;
+// PrintTypesTo() writes to any |out| with std::wcout's operator<<, e.g. a
+// Utf8Buffer; PrintTypes() writes to std::wcout.
+
+template <typename Out, typename T>
+void PrintTypesTo(Out& out, const T& x) {
+  out << std::left << std::setw(15) << x << std::setw(10) << std::right
+      << L" size = " << std::setw(2) << sizeof(x) << std::endl;
+}
+
+template <typename Out, typename T, typename... Types>
+void PrintTypesTo(Out& out, const T& x, const Types... args) {
+  out << std::left << std::setw(15) << x << std::setw(10) << std::right
+      << L" size = " << std::setw(2) << sizeof(x) << std::endl;
+  PrintTypesTo(out, args...);
 }
 
 template <typename T, typename... Types>
 void PrintTypes(const T& x, const Types... args) {
-  std::wcout << std::left << std::setw(15) << x << std::setw(10) << std::right
-             << L" size = " << std::setw(2) << sizeof(x) << std::endl;
-  PrintTypes(args...);
+  PrintTypesTo(std::wcout, x, args...);
 }
 
 // ###############################################################################
@@ -56,7 +64,7 @@ auto GetNumberParameters() -> std::vector<size_t> {
 
 template <typename... Types>
 auto GetTypesSize() -> std::deque<size_t> {
-  return std::deque<size_t> { sizeof(Types)...; }
+  return std::deque<size_t>{sizeof(Types)...};
 }
 
 // ###############################################################################